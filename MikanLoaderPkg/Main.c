@@ -193,7 +193,18 @@ void CopyLoadSegments(Elf64_Ehdr *ehdr) {
   }
 }
 
-EFI_STATUS ReadFile(EFI_FILE_PROTOCOL *file, VOID **buffer) {
+// The volume image is placed on page boundaries,
+// so that the kernel can map its clusters into applications.
+EFI_STATUS AllocateVolumeBuffer(UINTN bytes, VOID **buffer) {
+  EFI_PHYSICAL_ADDRESS addr;
+  EFI_STATUS status = gBS->AllocatePages(
+      AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(bytes), &addr);
+  *buffer = (VOID*)addr;
+  return status;
+}
+
+EFI_STATUS ReadFile(EFI_FILE_PROTOCOL *file, VOID **buffer,
+                    BOOLEAN page_aligned) {
   EFI_STATUS status;
 
   UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
@@ -208,7 +219,11 @@ EFI_STATUS ReadFile(EFI_FILE_PROTOCOL *file, VOID **buffer) {
   EFI_FILE_INFO *file_info = (EFI_FILE_INFO*)file_info_buffer;
   UINTN file_size = file_info->FileSize;
 
-  status = gBS->AllocatePool(EfiLoaderData, file_size, buffer);
+  if (page_aligned) {
+    status = AllocateVolumeBuffer(file_size, buffer);
+  } else {
+    status = gBS->AllocatePool(EfiLoaderData, file_size, buffer);
+  }
   if (EFI_ERROR(status)) {
     return status;
   }
@@ -248,7 +263,7 @@ EFI_STATUS ReadBlocks(
       UINTN read_bytes, VOID **buffer) {
   EFI_STATUS status;
 
-  status = gBS->AllocatePool(EfiLoaderData, read_bytes, buffer);
+  status = AllocateVolumeBuffer(read_bytes, buffer);
   if (EFI_ERROR(status)) {
     return status;
   }
@@ -337,7 +352,7 @@ EFI_STATUS EFIAPI UefiMain(
   }
 
   VOID *kernel_buffer;
-  status = ReadFile(kernel_file, &kernel_buffer);
+  status = ReadFile(kernel_file, &kernel_buffer, FALSE);
   if (EFI_ERROR(status)) {
     Print(L"error: %r", status);
     Halt();
@@ -371,7 +386,7 @@ EFI_STATUS EFIAPI UefiMain(
     root_dir, &volume_file, L"\\fat_disk",
     EFI_FILE_MODE_READ, 0);
   if (status == EFI_SUCCESS) {
-    status = ReadFile(volume_file, &volume_image);
+    status = ReadFile(volume_file, &volume_image, TRUE);
     if (EFI_ERROR(status)) {
     Print(L"failed to read volume file: %r", status);
     Halt();
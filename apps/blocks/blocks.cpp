@@ -82,6 +82,7 @@ extern "C" void main(int argc, char** argv) {
   int ball_dir = 0; // degree
   int ball_dx = 0, ball_dy = 0;
 
+  SyscallCreateHRTimer(TIMER_PERIODIC, 1, 1'000'000 / kFrameRate, nullptr);
   for (;;) {
     // 画面を一旦クリアし，各種オブジェクトを描画
     SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
@@ -94,15 +95,6 @@ extern "C" void main(int argc, char** argv) {
     }
     SyscallWinRedraw(layer_id);
 
-    static unsigned long prev_timeout = 0;
-    if (prev_timeout == 0) {
-      const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
-      prev_timeout = timeout.value;
-    } else {
-      prev_timeout += 1000 / kFrameRate;
-      SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
-    }
-
     // #@@range_begin(read_event)
     AppEvent events[1];
     for (;;) {
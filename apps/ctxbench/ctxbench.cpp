@@ -0,0 +1,66 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../syscall.h"
+
+// Measures how much of the TLB survives a trip through other tasks.
+// The working set is touched once while it is hot in the TLB and once
+// right after sleeping, that is, after the kernel and other tasks ran.
+// Run it in two terminals at once to switch between address spaces.
+
+namespace {
+
+uint64_t ReadTSC() {
+  return __builtin_ia32_rdtsc();
+}
+
+uint64_t Touch(volatile uint8_t *buf, size_t num_pages) {
+  const auto tsc0 = ReadTSC();
+  for (size_t i = 0; i < num_pages; ++i) {
+    buf[i * 4096];
+  }
+  return ReadTSC() - tsc0;
+}
+
+void Sleep(unsigned long ms) {
+  SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
+  AppEvent events[1];
+  while (true) {
+    SyscallReadEvent(events, 1);
+    if (events[0].type == AppEvent::kTimerTimeout) {
+      return;
+    }
+  }
+}
+
+} // namespace
+
+extern "C" void main(int argc, char **argv) {
+  const size_t num_pages = argc >= 2 ? atoi(argv[1]) : 64;
+  const int rounds = argc >= 3 ? atoi(argv[2]) : 100;
+
+  SyscallResult res = SyscallDemandPages(num_pages, 0);
+  if (res.error) {
+    printf("failed to demand %lu pages\n", num_pages);
+    exit(1);
+  }
+  auto buf = reinterpret_cast<volatile uint8_t*>(res.value);
+  for (size_t i = 0; i < num_pages; ++i) {
+    buf[i * 4096] = i;
+  }
+
+  uint64_t hot = 0, after_switch = 0;
+  for (int r = 0; r < rounds; ++r) {
+    Touch(buf, num_pages);
+    hot += Touch(buf, num_pages);
+    Sleep(10);
+    after_switch += Touch(buf, num_pages);
+  }
+
+  const auto accesses = num_pages * rounds;
+  printf("working set  : %lu pages, %d rounds\n", num_pages, rounds);
+  printf("hot          : %lu cycles/page\n", hot / accesses);
+  printf("after switch : %lu cycles/page\n", after_switch / accesses);
+  exit(0);
+}
@@ -23,5 +23,10 @@ extern "C" void main(int argc, char **argv) {
   }
   printf("\nread from mapped file (%lu bytes)\n", file_size);
 
+  res = SyscallUnmapFile(p);
+  if (res.error) {
+    exit(res.error);
+  }
+
   exit(0);
 }
@@ -1,12 +1,112 @@
 #include <errno.h>
+#include <malloc.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "syscall.h"
 
+/* Allocations this large get an anonymous mapping of their own,
+ * which free() returns to the OS at once. Smaller ones come from
+ * the newlib heap growing through sbrk.
+ */
+#define MMAP_THRESHOLD (128 * 1024)
+
+/* Header at the beginning of a mapped block; 16 bytes keep the alignment. */
+struct MappedBlock {
+  size_t bytes;
+  size_t reserved;
+};
+
+/* Mappings lie above the heap, so a pointer at or above the lowest
+ * mapping belongs to a mapped block.
+ */
+static uintptr_t mapped_low = UINTPTR_MAX;
+
+static int IsMapped(void *p) {
+  return (uintptr_t)p >= mapped_low;
+}
+
+static struct MappedBlock *BlockOf(void *p) {
+  return (struct MappedBlock*)((uintptr_t)p & ~(uintptr_t)4095);
+}
+
+static void *MapBlock(size_t size) {
+  const size_t bytes = sizeof(struct MappedBlock) + size;
+  if (bytes < size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  struct SyscallResult res = SyscallMapMemory(bytes, 0);
+  if (res.error) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (res.value < mapped_low) {
+    mapped_low = res.value;
+  }
+  struct MappedBlock *block = (struct MappedBlock*)res.value;
+  block->bytes = (bytes + 4095) & ~(size_t)4095;
+  return block + 1;
+}
+
+void *malloc(size_t size) {
+  if (size >= MMAP_THRESHOLD) {
+    return MapBlock(size);
+  }
+  return _malloc_r(_REENT, size);
+}
+
+void free(void *p) {
+  if (p && IsMapped(p)) {
+    SyscallUnmapMemory(BlockOf(p));
+    return;
+  }
+  _free_r(_REENT, p);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (size != 0 && n > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (n * size >= MMAP_THRESHOLD) {
+    return MapBlock(n * size); // mapped pages are zeroed
+  }
+  return _calloc_r(_REENT, n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  if (p == NULL) {
+    return malloc(size);
+  }
+  if (!IsMapped(p) && size < MMAP_THRESHOLD) {
+    return _realloc_r(_REENT, p, size);
+  }
+
+  size_t old_size;
+  if (IsMapped(p)) {
+    struct MappedBlock *block = BlockOf(p);
+    old_size = block->bytes - ((uintptr_t)p - (uintptr_t)block);
+    if (size >= MMAP_THRESHOLD && size <= old_size) {
+      return p;
+    }
+  } else {
+    old_size = malloc_usable_size(p);
+  }
+
+  void *q = malloc(size);
+  if (q == NULL) {
+    return NULL;
+  }
+  memcpy(q, p, old_size < size ? old_size : size);
+  free(p);
+  return q;
+}
+
 int close(int fd) {
   errno = EBADF;
   return -1;
@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+
+#include "../syscall.h"
+
+// Checks that the kernel writing into a read-only segment of an app
+// doesn't change the pages the app image shares with later launches.
+// Each run first checks the bytes an earlier run had the kernel overwrite,
+// then has SyscallReadFile overwrite them again. Run it twice.
+
+namespace {
+
+const char kOriginal[] = "segcheck: original read-only bytes";
+
+// Occupies a page of .rodata on its own.
+alignas(4096) const char ro_page[4096] = "segcheck: original read-only bytes";
+
+bool IsOriginal() {
+  const volatile char *p = ro_page;
+  for (size_t i = 0; i < sizeof(kOriginal); ++i) {
+    if (p[i] != kOriginal[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+extern "C" void main(int argc, char **argv) {
+  if (!IsOriginal()) {
+    printf("FAIL: read-only segment was changed by an earlier run\n");
+    exit(1);
+  }
+
+  const char *path = argc >= 2 ? argv[1] : "/memmap";
+  SyscallResult res = SyscallOpenFile(path, O_RDONLY);
+  if (res.error) {
+    printf("failed to open %s: %s\n", path, strerror(res.error));
+    exit(res.error);
+  }
+  const int fd = res.value;
+
+  res = SyscallReadFile(fd, const_cast<char*>(ro_page), sizeof(kOriginal));
+  if (res.error) {
+    printf("failed to read %s: %s\n", path, strerror(res.error));
+    exit(res.error);
+  }
+  if (IsOriginal()) {
+    printf("%s doesn't differ from the original bytes, try another file\n",
+           path);
+    exit(1);
+  }
+
+  printf("OK: this run saw its own copy; run again to check the next launch\n");
+  exit(0);
+}
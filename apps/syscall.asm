@@ -26,3 +26,8 @@ define_syscall OpenFile,         0x8000000c
 define_syscall ReadFile,         0x8000000d
 define_syscall DemandPages,      0x8000000e
 define_syscall MapFile,          0x8000000f
+define_syscall UnmapFile,        0x80000010
+define_syscall MapMemory,        0x80000011
+define_syscall UnmapMemory,      0x80000012
+define_syscall CreateHRTimer,    0x80000013
+define_syscall CancelTimer,      0x80000014
@@ -35,13 +35,27 @@ struct SyscallResult SyscallReadEvent(struct AppEvent *events, size_t len);
 
 #define TIMER_ONESHOT_REL 1
 #define TIMER_ONESHOT_ABS 0
+#define TIMER_PERIODIC    3 // every timeout from now on; CreateHRTimer only
 struct SyscallResult SyscallCreateTimer(
   unsigned int type, int timer_value, unsigned long timeout_ms);
+// timeout_us is in microseconds; returns the deadline in microseconds since boot.
+// The handle for SyscallCancelTimer is stored to *handle unless it is NULL.
+struct SyscallResult SyscallCreateHRTimer(
+  unsigned int type, int timer_value, unsigned long timeout_us, uint64_t *handle);
+// Only timers the calling app created can be cancelled (EPERM otherwise).
+struct SyscallResult SyscallCancelTimer(uint64_t handle);
 
 struct SyscallResult SyscallOpenFile(const char *path, int flags);
 struct SyscallResult SyscallReadFile(int fd, void *buf, size_t count);
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 struct SyscallResult SyscallMapFile(int fd, size_t *file_size, int flags);
+struct SyscallResult SyscallUnmapFile(void *addr);
+
+#define MEM_POPULATE  0x1 // map all pages at once instead of on page faults
+#define MEM_HUGE      0x2 // prefer 2 MiB pages; the mapping is 2 MiB aligned
+#define MEM_NORESERVE 0x4 // don't check that enough free memory exists
+struct SyscallResult SyscallMapMemory(size_t bytes, int flags);
+struct SyscallResult SyscallUnmapMemory(void *addr);
 
 #ifdef __cplusplus
 } // extern "C"
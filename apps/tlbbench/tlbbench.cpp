@@ -0,0 +1,62 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../syscall.h"
+
+// Measures the cost of page faults and TLB misses on a demand paged region.
+// A region of 2 MiB aligned blocks is mapped with huge pages,
+// so both the number of faults and the number of TLB misses drop.
+
+namespace {
+
+uint64_t ReadTSC() {
+  return __builtin_ia32_rdtsc();
+}
+
+uint64_t XorShift(uint64_t &x) {
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+} // namespace
+
+extern "C" void main(int argc, char **argv) {
+  const size_t mib = argc >= 2 ? atoi(argv[1]) : 64;
+  const size_t num_accesses = argc >= 3 ? atoi(argv[2]) : 4 * 1024 * 1024;
+  const size_t num_pages = mib * 256;
+
+  SyscallResult res = SyscallDemandPages(num_pages, 0);
+  if (res.error) {
+    printf("failed to demand %lu pages\n", num_pages);
+    exit(1);
+  }
+  auto buf = reinterpret_cast<volatile uint8_t*>(res.value);
+
+  // first touch of every 4 KiB page: page faults
+  const auto tick0 = SyscallGetCurrentTick();
+  const auto tsc0 = ReadTSC();
+  for (size_t i = 0; i < num_pages; ++i) {
+    buf[i * 4096] = i;
+  }
+  const auto tsc1 = ReadTSC();
+  const auto tick1 = SyscallGetCurrentTick();
+
+  // random reads, each on a different page: TLB misses
+  uint64_t x = 88172645463325252ull;
+  uint64_t sum = 0;
+  const auto tsc2 = ReadTSC();
+  for (size_t i = 0; i < num_accesses; ++i) {
+    sum += buf[(XorShift(x) % num_pages) * 4096];
+  }
+  const auto tsc3 = ReadTSC();
+
+  printf("region       : %lu MiB (%lu pages)\n", mib, num_pages);
+  printf("first touch  : %lu cycles/page (%lu ticks)\n",
+         (tsc1 - tsc0) / num_pages, tick1.value - tick0.value);
+  printf("random reads : %lu cycles/access (sum %lu)\n",
+         (tsc3 - tsc2) / num_accesses, sum);
+  exit(0);
+}
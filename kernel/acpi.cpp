@@ -69,6 +69,7 @@ size_t XSDT::Count() const {
 }
 
 const FADT *fadt;
+const MADT *madt;
 
 void WaitMilliseconds(unsigned long msec) {
   const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -97,11 +98,13 @@ void Initialize(const RSDP &rsdp) {
   }
 
   fadt = nullptr;
+  madt = nullptr;
   for (int i = 0; i < xsdt.Count(); ++i) {
     const auto &entry = xsdt[i];
     if (entry.IsValid("FACP")) { // FACP is the signature of FADT
       fadt = reinterpret_cast<const FADT*>(&entry);
-      break;
+    } else if (entry.IsValid("APIC")) { // APIC is the signature of MADT
+      madt = reinterpret_cast<const MADT*>(&entry);
     }
   }
 
@@ -50,7 +50,32 @@ struct FADT {
   char reserved3[276 - 116];
 } __attribute__((packed));
 
+/** @brief Multiple APIC Description Table.
+ * Interrupt controller structures of variable length follow the header.
+ */
+struct MADT {
+  DescriptionHeader header;
+
+  uint32_t lapic_address;
+  uint32_t flags;
+
+  /** @brief Calls func(apic_id) for each enabled processor local APIC. */
+  template <class Func>
+  void ForEachLocalAPIC(Func func) const {
+    auto p = reinterpret_cast<const uint8_t*>(this + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(this) + header.length;
+    while (p + 2 <= end && p[1] >= 2) {
+      // type 0: processor local APIC {type, length, processor id, APIC ID, flags}
+      if (p[0] == 0 && (p[4] & 1)) {
+        func(p[3]);
+      }
+      p += p[1];
+    }
+  }
+} __attribute__((packed));
+
 extern const FADT *fadt;
+extern const MADT *madt; // nullptr if the firmware provides none
 const int kPMTimerFreq = 3579545;
 
 void WaitMilliseconds(unsigned long msec);
@@ -96,6 +96,16 @@ GetCR3:
     mov rax, cr3
     ret
 
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -147,8 +157,14 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
 
     fxsave [rsi + 0xc0]
 
+extern cr3_no_flush_bit
+extern cr3_flush_next
+extern kernel_lock_owner
+
 global RestoreContext
 RestoreContext:  ; void RestoreContext(void* task_context);
+    cli
+
     ; stack frame for iret
     push qword [rdi + 0x28] ; SS
     push qword [rdi + 0x70] ; RSP
@@ -159,8 +175,23 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     ; return of context
     fxrstor [rdi + 0xc0]
 
+    ; CR3 is written only when the address space changes,
+    ; with the no-flush bit if PCIDs are enabled
     mov rax, [rdi + 0x00]
+    cmp byte [cr3_flush_next], 0
+    jne .cr3_flush
+    mov rdx, cr3
+    cmp rax, rdx
+    je .cr3_done
+    or rax, [cr3_no_flush_bit]
+    mov cr3, rax
+    jmp .cr3_done
+.cr3_flush:
+    ; The task last ran on another processor, so entries this processor
+    ; cached for its PCID may be stale
+    mov byte [cr3_flush_next], 0
     mov cr3, rax
+.cr3_done:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -183,6 +214,12 @@ RestoreContext:  ; void RestoreContext(void* task_context);
 
     mov rdi, [rdi + 0x60]
 
+    ; Release the kernel lock when returning to an application.
+    ; iret restores RFLAGS, so the flags may be changed here.
+    test byte [rsp + 0x08], 3  ; RPL of CS
+    jz .iret
+    mov dword [kernel_lock_owner], -1
+.iret:
     o64 iret
 
 global CallApp
@@ -198,10 +235,14 @@ CallApp:  ; int CallApp(int argc, char **argv, uint16_t ss,
 
     push rdx  ; SS
     push r8   ; RSP
+    pushfq
+    or qword [rsp], 0x200  ; RFLAGS with interrupts enabled
     add rdx, 8
     push rdx  ; CS
     push rcx  ; RIP
-    o64 retf
+    cli
+    mov dword [kernel_lock_owner], -1  ; release the kernel lock
+    o64 iret
     ; If the application is terminated, it will not come here.
 
 extern LAPICTimerOnInterrupt
@@ -325,6 +366,8 @@ SyscallEntry:  ; void SyscallEntry(void);
     cmp esi, 0x80000002
     je  .exit
 
+    cli
+    mov dword [kernel_lock_owner], -1  ; release the kernel lock
     pop r11
     pop rcx
     pop rbp
@@ -353,3 +396,67 @@ global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
 InvalidateTLB:
     invlpg [rdi]
     ret
+
+; Startup code of application processors.
+; StartApplicationProcessors copies APTrampoline to APTrampolineEnd to
+; kAPTrampolineAddr (smp.hpp) and fills ap_boot_data before sending startup
+; IPIs. The code runs at the copy, so addresses are relative to it.
+%define AP_ADDR(label) (0x8000 + ((label) - APTrampoline))
+
+bits 16
+global APTrampoline
+APTrampoline:
+    cli
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [AP_ADDR(ap_gdtr)]
+
+    mov eax, [AP_ADDR(ap_boot_data.cr4)]
+    mov cr4, eax
+    mov eax, [AP_ADDR(ap_boot_data.cr3)]
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 0x100        ; LME
+    wrmsr
+    mov eax, [AP_ADDR(ap_boot_data.cr0)]  ; enables protection and paging
+    mov cr0, eax
+    jmp dword 8:AP_ADDR(APTrampoline64)
+
+bits 64
+APTrampoline64:
+    mov ax, 16
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor eax, eax
+    mov fs, ax
+    mov gs, ax
+    mov rsp, [AP_ADDR(ap_boot_data.stack)]
+    mov edi, [AP_ADDR(ap_boot_data.cpu)]
+    call [AP_ADDR(ap_boot_data.entry)]
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00af9a000000ffff  ; 64-bit code segment
+    dq 0x00cf92000000ffff  ; data segment
+ap_gdtr:
+    dw ap_gdtr - ap_gdt - 1
+    dd AP_ADDR(ap_gdt)
+
+align 8
+global ap_boot_data
+ap_boot_data:  ; struct APBootData in smp.cpp
+.cr0:   dd 0
+.cr3:   dd 0
+.cr4:   dd 0
+.cpu:   dd 0
+.stack: dq 0
+.entry: dq 0
+
+global APTrampolineEnd
+APTrampolineEnd:
@@ -15,6 +15,8 @@ extern "C" {
   uint64_t GetCR2();
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  void SetCR4(uint64_t value);
+  uint64_t GetCR4();
   void SwitchContext(void *next_ctx, void *current_ctx);
   void RestoreContext(void *ctx);
   int CallApp(int argc, char **argv, uint16_t ss,
@@ -25,4 +27,5 @@ extern "C" {
   void SyscallEntry(void);
   void ExitApp(uint64_t rsp, int32_t ret_val);
   void InvalidateTLB(uint64_t addr);
+  extern uint8_t APTrampoline[], APTrampolineEnd[], ap_boot_data[];
 }
@@ -34,6 +34,7 @@ class Error {
       kIsDirectory,
       kNoSuchEntry,
       kFreeTypeError,
+      kNotPermitted,
       kLastOfCode,
     };
   
@@ -91,6 +92,7 @@ class Error {
       "kIsDirectory",
       "kNoSuchEntry",
       "kFreeTypeError",
+      "kNotPermitted",
     };
     static_assert(Error::Code::kLastOfCode == code_names_.size());
 
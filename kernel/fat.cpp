@@ -7,6 +7,7 @@
 
 #include "error.hpp"
 #include "file.hpp"
+#include "page_cache.hpp"
 
 namespace {
 
@@ -321,6 +322,7 @@ size_t FileDescriptor::Write(const void *buf, size_t len) {
 
   wr_off_ += total;
   fat_entry_.file_size = wr_off_;
+  InvalidatePageCache(CacheKey());
   return total;
 }
 
@@ -339,4 +341,27 @@ size_t FileDescriptor::Load(void *buf, size_t len, size_t offset) {
   return fd.Read(buf, len);
 }
 
+std::pair<uintptr_t, size_t>
+FileDescriptor::ContentExtent(size_t offset, size_t max_len) {
+  if (offset >= fat_entry_.file_size) {
+    return { 0, 0 };
+  }
+  max_len = std::min<size_t>(max_len, fat_entry_.file_size - offset);
+
+  unsigned long cluster = fat_entry_.FirstCluster();
+  while (offset >= bytes_per_cluster) {
+    offset -= bytes_per_cluster;
+    cluster = NextCluster(cluster);
+  }
+
+  // Clusters with consecutive numbers are adjacent in the volume image.
+  const uintptr_t addr = GetClusterAddr(cluster) + offset;
+  size_t len = bytes_per_cluster - offset;
+  while (len < max_len && NextCluster(cluster) == cluster + 1) {
+    ++cluster;
+    len += bytes_per_cluster;
+  }
+  return { addr, std::min(len, max_len) };
+}
+
 } // namespace fat
@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <utility>
 
 #include "error.hpp"
 #include "file.hpp"
@@ -192,6 +193,9 @@ class FileDescriptor : public ::FileDescriptor {
     size_t Write(const void *buf, size_t len) override;
     size_t Size() const override { return fat_entry_.file_size; }
     size_t Load(void *buf, size_t len, size_t offset) override;
+    std::pair<uintptr_t, size_t> ContentExtent(size_t offset,
+                                               size_t max_len) override;
+    const void *CacheKey() const override { return &fat_entry_; }
 
   private:
     DirectoryEntry &fat_entry_;
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <utility>
 
 class FileDescriptor {
   public:
@@ -11,6 +13,21 @@ class FileDescriptor {
 
     /** @brief Reads file content starting at the specified offset. */
     virtual size_t Load(void *buf, size_t len, size_t offset) = 0;
+
+    /** @brief Returns where the file content at offset resides in memory
+     * and how many bytes from there, up to max_len, are contiguous.
+     * Returns { 0, 0 } if the content isn't resident in memory.
+     */
+    virtual std::pair<uintptr_t, size_t> ContentExtent(size_t offset,
+                                                       size_t max_len) {
+      return { 0, 0 };
+    }
+
+    /** @brief Returns a key shared by the descriptors of the same file,
+     * under which the page cache keeps its content.
+     * nullptr means the content isn't cached.
+     */
+    virtual const void *CacheKey() const { return nullptr; }
 };
 
 size_t PrintToFD(FileDescriptor &fd, const char *format, ...);
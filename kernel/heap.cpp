@@ -0,0 +1,111 @@
+#include "heap.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <malloc.h>
+#include <sys/types.h>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+namespace {
+  // PML4 entry 1, next to the identity mapping in entry 0.
+  const uint64_t kHeapBase = 0x0000'0080'0000'0000;
+  const uint64_t kHeapEnd = kHeapBase + 512_GiB;
+  const uint64_t kPageBytes = 4_KiB;
+  const uint64_t kHugePageBytes = 2_MiB;
+
+  uint64_t program_break = kHeapBase;
+  uint64_t heap_mapped_end = kHeapBase;
+  size_t heap_huge_pages = 0;
+
+  uint64_t AlignUp(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+
+  /** @brief Unmaps the pages lying entirely above new_end. */
+  void ShrinkHeap(uint64_t new_end) {
+    while (heap_mapped_end > new_end) {
+      LinearAddress4Level last_page{heap_mapped_end - 1};
+      const auto page_bytes = KernelPageBytes(last_page);
+      if (page_bytes == 0 || heap_mapped_end - page_bytes < new_end) {
+        break;
+      }
+      if (auto err = UnmapKernelPage(last_page)) {
+        Log(kError, "failed to unmap the heap: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+        break;
+      }
+      heap_mapped_end -= page_bytes;
+      if (page_bytes == kHugePageBytes) {
+        --heap_huge_pages;
+      }
+    }
+  }
+
+  /** @brief Maps pages until the heap covers new_end.
+   * A 2 MiB page is used when a whole aligned one is needed.
+   */
+  Error GrowHeap(uint64_t new_end) {
+    while (heap_mapped_end < new_end) {
+      if (heap_mapped_end % kHugePageBytes == 0 &&
+          new_end - heap_mapped_end >= kHugePageBytes &&
+          !MapKernelPage(LinearAddress4Level{heap_mapped_end}, true)) {
+        heap_mapped_end += kHugePageBytes;
+        ++heap_huge_pages;
+        continue;
+      }
+      if (auto err = MapKernelPage(LinearAddress4Level{heap_mapped_end}, false)) {
+        return err;
+      }
+      heap_mapped_end += kPageBytes;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+} // namespace
+
+extern "C" caddr_t sbrk(int incr) {
+  const uint64_t prev_break = program_break;
+  const uint64_t new_break = prev_break + incr;
+  if (new_break < kHeapBase || kHeapEnd < new_break) {
+    errno = ENOMEM;
+    return reinterpret_cast<caddr_t>(-1);
+  }
+
+  if (incr > 0) {
+    if (GrowHeap(AlignUp(new_break, kPageBytes))) {
+      ShrinkHeap(AlignUp(prev_break, kPageBytes));
+      errno = ENOMEM;
+      return reinterpret_cast<caddr_t>(-1);
+    }
+  } else if (incr < 0) {
+    ShrinkHeap(AlignUp(new_break, kPageBytes));
+  }
+
+  program_break = new_break;
+  return reinterpret_cast<caddr_t>(prev_break);
+}
+
+void InitializeHeap() {
+  // Create the page tables for the heap area now,
+  // so that the PML4 entry is copied into the PML4 of every application.
+  if (auto err = GrowHeap(kHeapBase + kPageBytes)) {
+    Log(kError, "failed to set up the heap: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+    exit(1);
+  }
+}
+
+HeapStat GetHeapStat() {
+  const auto info = mallinfo();
+  return {
+    heap_mapped_end - kHeapBase,
+    heap_huge_pages,
+    info.uordblks,
+    info.fordblks,
+    info.ordblks,
+    info.keepcost,
+  };
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+
+/** @brief Usage of the kernel heap (bytes) */
+struct HeapStat {
+  size_t mapped_bytes;   // memory mapped to the heap area
+  size_t huge_pages;     // the number of 2 MiB pages among mapped_bytes
+  size_t in_use_bytes;   // memory allocated by malloc
+  size_t free_bytes;     // memory malloc holds as free chunks
+  size_t free_chunks;    // the number of free chunks
+  size_t top_free_bytes; // part of free_bytes at the top of the heap,
+                         // which can be returned to the frame allocator
+};
+
+/** @brief Sets up the kernel heap used by malloc and operator new.
+ *
+ * The heap lives in a dedicated virtual address range above the identity
+ * mapping. sbrk maps pages to the range as the heap grows and unmaps them,
+ * returning the frames to memory_manager, when malloc trims the heap.
+ */
+void InitializeHeap();
+
+HeapStat GetHeapStat();
@@ -11,6 +11,7 @@
 #include "message.hpp"
 #include "paging.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 
@@ -36,6 +37,7 @@ namespace {
 
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame *frame) {
+    KernelLockGuard lock;
     task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
     NotifyEndOfInterrupt();
   }
@@ -77,8 +79,9 @@ namespace {
 
   __attribute__((interrupt))
   void IntHandlerPF(InterruptFrame *frame, uint64_t error_code) {
+    KernelLockGuard lock;
     uint64_t cr2 = GetCR2();
-    if (auto err = HandlePageFault(error_code, cr2); !err) {
+    if (auto err = HandlePageFault(error_code, cr2, frame->rsp); !err) {
       return;
     }
     KillApp(frame);
@@ -91,6 +94,7 @@ namespace {
 #define FaultHandlerWithError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame, uint64_t error_code) { \
+    KernelLockGuard lock; \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     WriteString(*screen_writer, {500, 16*4}, "ERR", {0, 0, 0}); \
@@ -101,6 +105,7 @@ namespace {
 #define FaultHandlerNoError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame) { \
+    KernelLockGuard lock; \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     while (true) __asm__("hlt"); \
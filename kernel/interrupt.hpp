@@ -68,4 +68,20 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+/** @brief Disables interrupts, returning whether they were enabled.
+ * For code that runs both in tasks and in interrupt handlers,
+ * where a plain cli/sti pair would enable interrupts too early.
+ */
+inline bool SaveAndDisableInterrupts() {
+  uint64_t rflags;
+  __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) :: "memory");
+  return rflags & (1u << 9);
+}
+
+inline void RestoreInterrupts(bool enabled) {
+  if (enabled) {
+    __asm__ volatile("sti" ::: "memory");
+  }
+}
+
 void InitializeInterrupt();
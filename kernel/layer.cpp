@@ -8,6 +8,7 @@
 #include "graphics.hpp"
 #include "logger.hpp"
 #include "message.hpp"
+#include "slab.hpp"
 #include "task.hpp"
 #include "window.hpp"
 
@@ -266,11 +267,11 @@ std::map<unsigned int, uint64_t> *layer_task_map;
 void InitializeLayer() {
   const auto screen_size = ScreenSize();
 
-  auto bgwindow = std::make_shared<Window>(
+  auto bgwindow = MakeSlabShared<Window>(
     screen_size.x, screen_size.y, screen_config.pixel_format);
   DrawDesktop(*bgwindow->Writer());
 
-  auto console_window = std::make_shared<Window>(
+  auto console_window = MakeSlabShared<Window>(
     Console::kColumns * 8, Console::kRows * 16, screen_config.pixel_format);
   console->SetWindow(console_window);
 
@@ -8,9 +8,10 @@
 #include "error.hpp"
 #include "graphics.hpp"
 #include "message.hpp"
+#include "slab.hpp"
 #include "window.hpp"
 
-class Layer {
+class Layer : public SlabObject<Layer> {
   public:
     Layer(unsigned int id = 0);
     unsigned int ID() const;
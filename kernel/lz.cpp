@@ -0,0 +1,171 @@
+#include "lz.hpp"
+
+#include <cstring>
+
+namespace {
+  const size_t kMinMatch = 4;
+  const size_t kMaxOffset = 65535;
+  const int kHashBits = __builtin_ctzl(kLZHashEntries);
+  // The last match must end this far before the end of the input
+  // and the last bytes are always literals, as in LZ4.
+  const size_t kLastLiterals = 5;
+
+  uint32_t Read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  uint32_t Hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - kHashBits);
+  }
+
+  /** @brief Writes the part of len not fitting in a token nibble. */
+  uint8_t *WriteLength(uint8_t *op, uint8_t *op_end, size_t len) {
+    for (; len >= 255; len -= 255) {
+      if (op >= op_end) {
+        return nullptr;
+      }
+      *op++ = 255;
+    }
+    if (op >= op_end) {
+      return nullptr;
+    }
+    *op++ = len;
+    return op;
+  }
+
+  /** @brief Reads a length extended beyond 15. */
+  bool ReadLength(const uint8_t *&ip, const uint8_t *ip_end, size_t &len) {
+    uint8_t b;
+    do {
+      if (ip >= ip_end) {
+        return false;
+      }
+      b = *ip++;
+      len += b;
+    } while (b == 255);
+    return true;
+  }
+
+  uint8_t *WriteSequence(uint8_t *op, uint8_t *op_end,
+                         const uint8_t *literals, size_t lit_len,
+                         size_t offset, size_t match_len) {
+    if (op >= op_end) {
+      return nullptr;
+    }
+    uint8_t *token = op++;
+    const size_t match_code = match_len ? match_len - kMinMatch : 0;
+    *token = (lit_len < 15 ? lit_len : 15) << 4 |
+             (match_code < 15 ? match_code : 15);
+    if (lit_len >= 15 && !(op = WriteLength(op, op_end, lit_len - 15))) {
+      return nullptr;
+    }
+    if (static_cast<size_t>(op_end - op) < lit_len) {
+      return nullptr;
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+      return op;
+    }
+
+    if (op_end - op < 2) {
+      return nullptr;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (match_code >= 15 && !(op = WriteLength(op, op_end, match_code - 15))) {
+      return nullptr;
+    }
+    return op;
+  }
+} // namespace
+
+size_t LZCompress(const uint8_t *src, size_t src_len,
+                  uint8_t *dst, size_t dst_len, uint16_t *table) {
+  memset(table, 0, kLZHashEntries * sizeof(*table));
+
+  uint8_t *op = dst;
+  uint8_t *const op_end = dst + dst_len;
+  const uint8_t *anchor = src; // beginning of pending literals
+  const uint8_t *ip = src;
+  const uint8_t *const match_limit =
+    src_len > kLastLiterals + kMinMatch ? src + src_len - kLastLiterals : src;
+
+  // Positions are stored as offset + 1 so that 0 means no entry;
+  // blocks up to 64 KiB can be compressed.
+  while (ip + kMinMatch <= match_limit) {
+    const uint32_t seq = Read32(ip);
+    const uint32_t h = Hash(seq);
+    const uint8_t *ref = table[h] ? src + table[h] - 1 : nullptr;
+    table[h] = ip - src + 1;
+
+    if (ref == nullptr || ip - ref > kMaxOffset || Read32(ref) != seq) {
+      ++ip;
+      continue;
+    }
+
+    size_t match_len = kMinMatch;
+    while (ip + match_len < match_limit && ref[match_len] == ip[match_len]) {
+      ++match_len;
+    }
+    op = WriteSequence(op, op_end, anchor, ip - anchor, ip - ref, match_len);
+    if (op == nullptr) {
+      return 0;
+    }
+    ip += match_len;
+    anchor = ip;
+  }
+
+  op = WriteSequence(op, op_end, anchor, src + src_len - anchor, 0, 0);
+  return op ? op - dst : 0;
+}
+
+size_t LZDecompress(const uint8_t *src, size_t src_len,
+                    uint8_t *dst, size_t dst_len) {
+  const uint8_t *ip = src;
+  const uint8_t *const ip_end = src + src_len;
+  uint8_t *op = dst;
+  uint8_t *const op_end = dst + dst_len;
+
+  while (ip < ip_end) {
+    const uint8_t token = *ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !ReadLength(ip, ip_end, lit_len)) {
+      return 0;
+    }
+    if (static_cast<size_t>(ip_end - ip) < lit_len ||
+        static_cast<size_t>(op_end - op) < lit_len) {
+      return 0;
+    }
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == ip_end) {
+      break; // the last sequence has no match
+    }
+
+    if (ip_end - ip < 2) {
+      return 0;
+    }
+    const size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 0xf;
+    if (match_len == 15 && !ReadLength(ip, ip_end, match_len)) {
+      return 0;
+    }
+    match_len += kMinMatch;
+    if (offset == 0 || static_cast<size_t>(op - dst) < offset ||
+        static_cast<size_t>(op_end - op) < match_len) {
+      return 0;
+    }
+    // Copy byte by byte since the match may overlap its output.
+    const uint8_t *ref = op - offset;
+    for (size_t i = 0; i < match_len; ++i) {
+      op[i] = ref[i];
+    }
+    op += match_len;
+  }
+  return op - dst;
+}
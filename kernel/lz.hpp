@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/** @brief The number of entries of the hash table LZCompress works in */
+const size_t kLZHashEntries = 1 << 12;
+
+/** @brief Compresses src into dst with a byte-oriented LZ77 codec
+ * in the style of the LZ4 block format.
+ *
+ * A block is a sequence of (token, literals, offset, match) where the
+ * token holds 4-bit literal and match lengths, extended by 255-valued
+ * bytes. Matches are at least 4 bytes long and at most 64 KiB back.
+ * The compressor finds them through a small hash table of 4-byte
+ * prefixes, trading ratio for speed. The caller provides the table
+ * (kLZHashEntries entries), so that compressing needs little stack.
+ *
+ * @return The compressed size, or 0 if it would exceed dst_len
+ */
+size_t LZCompress(const uint8_t *src, size_t src_len,
+                  uint8_t *dst, size_t dst_len, uint16_t *hash_table);
+
+/** @brief Decompresses a block made by LZCompress.
+ * @return The decompressed size, or 0 if the block is malformed or
+ *   doesn't fit in dst_len
+ */
+size_t LZDecompress(const uint8_t *src, size_t src_len,
+                    uint8_t *dst, size_t dst_len);
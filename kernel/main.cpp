@@ -15,6 +15,7 @@
 #include "font.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
+#include "heap.hpp"
 #include "interrupt.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
@@ -22,9 +23,13 @@
 #include "memory_manager.hpp"
 #include "memory_map.hpp"
 #include "mouse.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "reclaim.hpp"
 #include "segment.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
 #include "syscall.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
@@ -48,7 +53,7 @@ int printk(const char *format, ...) {
 std::shared_ptr<ToplevelWindow> main_window;
 unsigned int main_window_layer_id;
 void InitializeMainWindow() {
-  main_window = std::make_shared<ToplevelWindow>(
+  main_window = MakeSlabShared<ToplevelWindow>(
     160, 52, screen_config.pixel_format, "Hello Window");
 
   main_window_layer_id = layer_manager->NewLayer()
@@ -66,7 +71,7 @@ void InitializeTextWindow() {
   const int win_w = 160;
   const int win_h = 52;
 
-  text_window = std::make_shared<ToplevelWindow>(
+  text_window = MakeSlabShared<ToplevelWindow>(
     win_w, win_h, screen_config.pixel_format, "Text Box Test");
   DrawTextbox(*text_window->InnerWriter(), {0, 0}, text_window->InnerSize());
 
@@ -126,8 +131,9 @@ extern "C" void KernelMainNewStack(
   
   SetLogLevel(kWarn);
   InitializeSegmentation();
-  InitializePaging();
+  InitializePaging(memory_map);
   InitializeMemoryManager(memory_map);
+  InitializeHeap();
   InitializeTSS();
   InitializeInterrupt();
 
@@ -145,13 +151,17 @@ extern "C" void KernelMainNewStack(
 
   const int kTextboxCursorTimer = 1;
   const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
-  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1});
+  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1}
+    .SetPeriod(kTimer05Sec * kNanosecondsPerTick, kTimer05Sec));
   bool textbox_cursor_visible = false;
 
   InitializeSyscall();
 
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
+  InitializeReclaim();
+  InitializePageCache();
+  StartApplicationProcessors();
 
   usb::xhci::Initialize();
   InitializeKeyboard();
@@ -190,10 +200,6 @@ extern "C" void KernelMainNewStack(
 
     case Message::kTimerTimeout:
       if (msg->arg.timer.value == kTextboxCursorTimer) {
-        __asm__("cli");
-        timer_manager->AddTimer(
-          Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
-        __asm__("sti");
         textbox_cursor_visible = !textbox_cursor_visible;
         DrawTextCursor(textbox_cursor_visible);
         layer_manager->Draw(text_window_layer_id);
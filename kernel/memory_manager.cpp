@@ -1,68 +1,190 @@
 #include "memory_manager.hpp"
 
-#include <bitset>
+#include <algorithm>
 #include <cstddef>
-#include <sys/types.h>
 
 #include "error.hpp"
 #include "logger.hpp"
 #include "memory_map.hpp"
+#include "smp.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager()
-  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+namespace {
+  size_t CeilDiv(size_t value, size_t divisor) {
+    return (value + divisor - 1) / divisor;
+  }
+
+  /** @brief Returns the smallest order whose block holds num_frames frames. */
+  int OrderOf(size_t num_frames) {
+    int order = 0;
+    while ((static_cast<size_t>(1) << order) < num_frames) {
+      ++order;
+    }
+    return order;
+  }
+} // namespace
+
+size_t BitmapMemoryManager::MapBytes(FrameID frame_end) {
+  const size_t map_lines = CeilDiv(frame_end.ID(), kBitsPerMapLine);
+  const size_t summary_lines = CeilDiv(map_lines, kBitsPerMapLine);
+  return (map_lines + summary_lines) * sizeof(MapLineType) +
+         frame_end.ID() * sizeof(uint16_t);
+}
+
+BitmapMemoryManager::BitmapMemoryManager(FrameID frame_end, void *map_buf)
+  : frame_count_{frame_end.ID()},
+    alloc_map_{reinterpret_cast<MapLineType*>(map_buf)},
+    free_line_map_{alloc_map_ + CeilDiv(frame_count_, kBitsPerMapLine)},
+    ref_counts_{reinterpret_cast<uint16_t*>(
+      free_line_map_ + CeilDiv(frame_count_, kBitsPerMapLine * kBitsPerMapLine))},
+    free_lists_{}, free_frames_{0},
+    range_begin_{FrameID{0}}, range_end_{FrameID{0}} {
+  const size_t map_lines = CeilDiv(frame_count_, kBitsPerMapLine);
+  const size_t summary_lines = CeilDiv(map_lines, kBitsPerMapLine);
+  std::fill_n(alloc_map_, map_lines, 0);
+  std::fill_n(free_line_map_, summary_lines, ~static_cast<MapLineType>(0));
+  std::fill_n(ref_counts_, frame_count_, 0);
 }
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
-  while (true) {
-    size_t i = 0;
-    for (; i < num_frames; ++i) {
-      if (start_frame_id + i >= range_end_.ID()) {
-        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-      }
-      if (GetBit(FrameID{start_frame_id + i})) {
-        // The frame on 'start_frame_id + i' is already allocated.
-        break;
-      }
-    }
+  const int order = OrderOf(num_frames);
+  if (order > kMaxOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
 
-    if (i == num_frames) {
-      MarkAllocated(FrameID{start_frame_id}, num_frames);
-      return {
-        FrameID{start_frame_id},
-        MAKE_ERROR(Error::kSuccess),
-      };
-    }
+  int block_order = order;
+  while (block_order <= kMaxOrder && free_lists_[block_order] == nullptr) {
+    ++block_order;
+  }
+  if (block_order > kMaxOrder) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
 
-    start_frame_id += i + 1;
+  FreeBlock *block = free_lists_[block_order];
+  RemoveBlock(block);
+  const size_t start_frame_id =
+    reinterpret_cast<uintptr_t>(block) / kBytesPerFrame;
+
+  // Split the block and return upper halves to the free lists.
+  while (block_order > order) {
+    --block_order;
+    PushBlock(start_frame_id + (static_cast<size_t>(1) << block_order),
+              block_order);
   }
+
+  const size_t block_frames = static_cast<size_t>(1) << order;
+  SetBits(start_frame_id, start_frame_id + block_frames, true);
+  free_frames_ -= block_frames;
+  // Give back the tail that exceeds num_frames.
+  ReleaseRange(start_frame_id + num_frames, start_frame_id + block_frames);
+
+  return {
+    FrameID{start_frame_id},
+    MAKE_ERROR(Error::kSuccess),
+  };
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, false);
+  const size_t end = std::min(start_frame.ID() + num_frames, range_end_.ID());
+  // Frames which have already been freed are skipped.
+  size_t i = FindAllocatedFrame(
+    std::max(start_frame.ID(), range_begin_.ID()), end);
+  while (i < end) {
+    const size_t run_end = FindFreeFrame(i, end);
+    ReleaseRange(i, run_end);
+    i = FindAllocatedFrame(run_end, end);
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, true);
+  const size_t begin = start_frame.ID();
+  const size_t end = std::min(begin + num_frames, frame_count_);
+
+  // Frames out of the range are not managed by the free lists.
+  SetBits(begin, std::min(end, range_begin_.ID()), true);
+  SetBits(std::max(begin, range_end_.ID()), end, true);
+
+  const size_t range_end = std::min(end, range_end_.ID());
+  size_t i = FindFreeFrame(std::max(begin, range_begin_.ID()), range_end);
+  while (i < range_end) {
+    // Carve [i, end) out of the free block containing frame i.
+    const auto block = FindBlock(i);
+    if (!block) {
+      SetBit(FrameID{i}, true);
+      i = FindFreeFrame(i + 1, range_end);
+      continue;
+    }
+    const size_t block_frame = *block;
+    const size_t block_end =
+      block_frame + (static_cast<size_t>(1) << BlockAt(block_frame)->order);
+    RemoveBlock(BlockAt(block_frame));
+    SetBits(block_frame, block_end, true);
+    free_frames_ -= block_end - block_frame;
+
+    ReleaseRange(block_frame, i);
+    ReleaseRange(std::min(end, block_end), block_end);
+    i = FindFreeFrame(std::min(end, block_end), range_end);
   }
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
   range_begin_ = range_begin;
-  range_end_ = range_end;
+  range_end_ = FrameID{std::min(range_end.ID(), frame_count_)};
+
+  free_lists_.fill(nullptr);
+  free_frames_ = 0;
+
+  // Split each run of free frames into maximal aligned blocks.
+  // They cannot be merged with each other, so no coalescing is needed.
+  size_t i = FindFreeFrame(range_begin_.ID(), range_end_.ID());
+  while (i < range_end_.ID()) {
+    int order = kMaxOrder;
+    while ((i & ((static_cast<size_t>(1) << order) - 1)) != 0 ||
+           i + (static_cast<size_t>(1) << order) > range_end_.ID()) {
+      --order;
+    }
+    const size_t run =
+      FindAllocatedFrame(i, i + (static_cast<size_t>(1) << order)) - i;
+    order = std::min(order, OrderOf(run + 1) - 1);
+    PushBlock(i, order);
+    free_frames_ += static_cast<size_t>(1) << order;
+    i = FindFreeFrame(i + (static_cast<size_t>(1) << order), range_end_.ID());
+  }
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
-  size_t sum = 0;
-  for (int i = range_begin_.ID() / kBitsPerMapLine;
-       i < range_end_.ID() / kBitsPerMapLine; ++i) {
-    sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
+  const size_t total = range_end_.ID() - range_begin_.ID();
+  return { total - free_frames_, total };
+}
+
+uint16_t BitmapMemoryManager::RefCount(FrameID frame) const {
+  if (frame.ID() >= frame_count_) {
+    return kPinnedRefCount;
+  }
+  return ref_counts_[frame.ID()];
+}
+
+void BitmapMemoryManager::IncrementRefCount(FrameID frame) {
+  if (frame.ID() < frame_count_ && ref_counts_[frame.ID()] < kPinnedRefCount) {
+    ++ref_counts_[frame.ID()];
+  }
+}
+
+uint16_t BitmapMemoryManager::DecrementRefCount(FrameID frame) {
+  if (frame.ID() >= frame_count_) {
+    return kPinnedRefCount;
+  }
+  auto &count = ref_counts_[frame.ID()];
+  if (0 < count && count < kPinnedRefCount) {
+    --count;
+  }
+  return count;
+}
+
+void BitmapMemoryManager::PinFrame(FrameID frame) {
+  if (frame.ID() < frame_count_) {
+    ref_counts_[frame.ID()] = kPinnedRefCount;
   }
-  return { sum, range_end_.ID() - range_begin_.ID() };
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -74,70 +196,280 @@ bool BitmapMemoryManager::GetBit(FrameID frame) const {
 }
 
 void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-  auto line_index = frame.ID() / kBitsPerMapLine;
-  auto bit_index = frame.ID() % kBitsPerMapLine;
+  SetBits(frame.ID(), frame.ID() + 1, allocated);
+}
+
+void BitmapMemoryManager::SetBits(size_t begin, size_t end, bool allocated) {
+  while (begin < end) {
+    const auto line_index = begin / kBitsPerMapLine;
+    const auto bit_index = begin % kBitsPerMapLine;
+    const auto num_bits = std::min(end - begin, kBitsPerMapLine - bit_index);
+    const auto mask = (num_bits == kBitsPerMapLine
+      ? ~static_cast<MapLineType>(0)
+      : (static_cast<MapLineType>(1) << num_bits) - 1) << bit_index;
+
+    if (allocated) {
+      alloc_map_[line_index] |= mask;
+    } else {
+      alloc_map_[line_index] &= ~mask;
+    }
+
+    const auto summary_bit =
+      static_cast<MapLineType>(1) << (line_index % kBitsPerMapLine);
+    if (alloc_map_[line_index] == ~static_cast<MapLineType>(0)) {
+      free_line_map_[line_index / kBitsPerMapLine] &= ~summary_bit;
+    } else {
+      free_line_map_[line_index / kBitsPerMapLine] |= summary_bit;
+    }
+
+    begin += num_bits;
+  }
+}
+
+/** @brief Returns the first free frame in [begin, end), or end if none.
+ * Fully allocated lines are skipped with the summary level.
+ */
+size_t BitmapMemoryManager::FindFreeFrame(size_t begin, size_t end) const {
+  if (begin >= end) {
+    return end;
+  }
 
-  if (allocated) {
-    alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
+  size_t line_index = begin / kBitsPerMapLine;
+  MapLineType free_bits = ~alloc_map_[line_index] &
+    (~static_cast<MapLineType>(0) << (begin % kBitsPerMapLine));
+  const size_t summary_lines =
+    CeilDiv(CeilDiv(frame_count_, kBitsPerMapLine), kBitsPerMapLine);
+  while (free_bits == 0) {
+    ++line_index;
+    if (line_index * kBitsPerMapLine >= end) {
+      return end;
+    }
+    size_t summary_index = line_index / kBitsPerMapLine;
+    MapLineType summary = free_line_map_[summary_index] &
+      (~static_cast<MapLineType>(0) << (line_index % kBitsPerMapLine));
+    while (summary == 0) {
+      ++summary_index;
+      if (summary_index >= summary_lines ||
+          summary_index * kBitsPerMapLine * kBitsPerMapLine >= end) {
+        return end;
+      }
+      summary = free_line_map_[summary_index];
+    }
+    line_index = summary_index * kBitsPerMapLine + __builtin_ctzl(summary);
+    if (line_index * kBitsPerMapLine >= end) {
+      return end;
+    }
+    free_bits = ~alloc_map_[line_index];
+  }
+  return std::min(end, line_index * kBitsPerMapLine + __builtin_ctzl(free_bits));
+}
+
+/** @brief Returns the first allocated frame in [begin, end), or end if none. */
+size_t BitmapMemoryManager::FindAllocatedFrame(size_t begin, size_t end) const {
+  if (begin >= end) {
+    return end;
+  }
+
+  size_t line_index = begin / kBitsPerMapLine;
+  MapLineType allocated_bits = alloc_map_[line_index] &
+    (~static_cast<MapLineType>(0) << (begin % kBitsPerMapLine));
+  while (allocated_bits == 0) {
+    ++line_index;
+    if (line_index * kBitsPerMapLine >= end) {
+      return end;
+    }
+    allocated_bits = alloc_map_[line_index];
+  }
+  return std::min(end,
+                  line_index * kBitsPerMapLine + __builtin_ctzl(allocated_bits));
+}
+
+BitmapMemoryManager::FreeBlock *BitmapMemoryManager::BlockAt(size_t frame) const {
+  return reinterpret_cast<FreeBlock*>(FrameID{frame}.Frame());
+}
+
+/** A free frame whose buddy is in use is always the head of a listed block,
+ * so the header in the frame can be trusted once the bit is confirmed clear.
+ */
+bool BitmapMemoryManager::IsFreeBlock(size_t frame, int order) const {
+  return range_begin_.ID() <= frame &&
+         frame + (static_cast<size_t>(1) << order) <= range_end_.ID() &&
+         !GetBit(FrameID{frame}) &&
+         BlockAt(frame)->order == order;
+}
+
+void BitmapMemoryManager::PushBlock(size_t frame, int order) {
+  FreeBlock *block = BlockAt(frame);
+  block->order = order;
+  block->prev = nullptr;
+  block->next = free_lists_[order];
+  if (block->next) {
+    block->next->prev = block;
+  }
+  free_lists_[order] = block;
+}
+
+void BitmapMemoryManager::RemoveBlock(FreeBlock *block) {
+  if (block->prev) {
+    block->prev->next = block->next;
   } else {
-    alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+    free_lists_[block->order] = block->next;
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
   }
 }
 
-// #@@range_begin(set_program_break)
-extern "C" caddr_t program_break, program_break_end;
-// #@@range_end(set_program_break)
+void BitmapMemoryManager::InsertBlock(size_t frame, int order) {
+  while (order < kMaxOrder) {
+    const size_t buddy = frame ^ (static_cast<size_t>(1) << order);
+    if (!IsFreeBlock(buddy, order)) {
+      break;
+    }
+    RemoveBlock(BlockAt(buddy));
+    frame &= ~(static_cast<size_t>(1) << order);
+    ++order;
+  }
+  PushBlock(frame, order);
+}
+
+/** @brief Returns allocated frames [begin, end) to the free lists.
+ * Bits are cleared one block at a time so that IsFreeBlock never sees
+ * a free frame which is not yet in the lists.
+ */
+void BitmapMemoryManager::ReleaseRange(size_t begin, size_t end) {
+  while (begin < end) {
+    int order = 0;
+    while (order < kMaxOrder &&
+           (begin & ((static_cast<size_t>(1) << (order + 1)) - 1)) == 0 &&
+           begin + (static_cast<size_t>(1) << (order + 1)) <= end) {
+      ++order;
+    }
+    const size_t block_frames = static_cast<size_t>(1) << order;
+    SetBits(begin, begin + block_frames, false);
+    free_frames_ += block_frames;
+    InsertBlock(begin, order);
+    begin += block_frames;
+  }
+}
+
+/** @brief Returns the head of the free block containing the free frame.
+ * Searching from the largest order is safe: an aligned free frame above
+ * the real head is itself a head of another order.
+ */
+std::optional<size_t> BitmapMemoryManager::FindBlock(size_t frame) const {
+  for (int order = kMaxOrder; order >= 0; --order) {
+    const size_t head = frame & ~((static_cast<size_t>(1) << order) - 1);
+    if (IsFreeBlock(head, order)) {
+      return head;
+    }
+  }
+  return std::nullopt;
+}
 
 namespace {
   char memory_manager_buf[sizeof(BitmapMemoryManager)];
 
-  Error InitializeHeap(BitmapMemoryManager &memory_manager) {
-  const int kHeapFrames = 64 * 512;
-  const auto heap_start = memory_manager.Allocate(kHeapFrames);
-  if (heap_start.error) {
-    return heap_start.error;
-  }
+  /** @brief Frames taken by AllocateBootFrames ([begin, end) of frame IDs) */
+  struct BootFrames {
+    size_t begin, end;
+  };
+  std::array<BootFrames, 8> boot_frames;
+  size_t num_boot_frames = 0;
 
-  program_break = reinterpret_cast<caddr_t>(
-    heap_start.value.ID() * kBytesPerFrame);
-  program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-  return MAKE_ERROR(Error::kSuccess);
-}
+  /** @brief The frame StartApplicationProcessors copies the startup code to */
+  const size_t kAPTrampolineFrame = kAPTrampolineAddr / kBytesPerFrame;
 } // namespace
 
 BitmapMemoryManager *memory_manager;
 
+// Boot services memory is avoided because the memory map itself
+// may still live there.
+WithError<FrameID> AllocateBootFrames(const MemoryMap &memory_map,
+                                      size_t num_frames) {
+  if (num_boot_frames == boot_frames.size()) {
+    return { kNullFrame, MAKE_ERROR(Error::kFull) };
+  }
+
+  FrameID found = kNullFrame;
+  ForEachDescriptor(memory_map, [&](const MemoryDescriptor &desc) {
+    if (found.ID() != kNullFrame.ID() ||
+        static_cast<MemoryType>(desc.type) != MemoryType::kEfiConventionalMemory ||
+        desc.physical_start == 0) {
+      return;
+    }
+    size_t begin = desc.physical_start / kBytesPerFrame;
+    const size_t end = begin + desc.number_of_pages * kUEFIPageSize / kBytesPerFrame;
+    if (begin <= kAPTrampolineFrame && kAPTrampolineFrame < end) {
+      begin = kAPTrampolineFrame + 1;
+    }
+
+    // skip the frames already taken from the beginning of this region
+    bool skipped = true;
+    while (skipped) {
+      skipped = false;
+      for (size_t i = 0; i < num_boot_frames; ++i) {
+        if (boot_frames[i].begin <= begin && begin < boot_frames[i].end) {
+          begin = boot_frames[i].end;
+          skipped = true;
+        }
+      }
+    }
+    if (begin + num_frames <= end) {
+      found = FrameID{begin};
+    }
+  });
+  if (found.ID() == kNullFrame.ID()) {
+    return { kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory) };
+  }
+
+  boot_frames[num_boot_frames++] = {found.ID(), found.ID() + num_frames};
+  return { found, MAKE_ERROR(Error::kSuccess) };
+}
+
 void InitializeMemoryManager(const MemoryMap &memory_map) {
-  ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
+  uintptr_t frame_end = 0;
+  ForEachDescriptor(memory_map, [&](const MemoryDescriptor &desc) {
+    const auto physical_end =
+      desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+    if (IsAvailable(static_cast<MemoryType>(desc.type))) {
+      frame_end = std::max<uintptr_t>(frame_end, physical_end / kBytesPerFrame);
+    }
+  });
+
+  const size_t map_frames = CeilDiv(
+    BitmapMemoryManager::MapBytes(FrameID{frame_end}), kBytesPerFrame);
+  const auto [ map_frame, map_err ] = AllocateBootFrames(memory_map, map_frames);
+  if (map_err) {
+    Log(kError, "failed to place the frame bitmap: %s at %s:%d\n",
+        map_err.Name(), map_err.File(), map_err.Line());
+    exit(1);
+  }
+  ::memory_manager = new(memory_manager_buf) BitmapMemoryManager{
+    FrameID{frame_end}, map_frame.Frame()};
 
-  const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
   uintptr_t available_end = 0;
-  for (uintptr_t iter = memory_map_base;
-       iter < memory_map_base + memory_map.map_size;
-       iter += memory_map.descriptor_size) {
-    auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
-    if (available_end < desc->physical_start) {
+  ForEachDescriptor(memory_map, [&](const MemoryDescriptor &desc) {
+    if (available_end < desc.physical_start) {
       memory_manager->MarkAllocated(
         FrameID{available_end / kBytesPerFrame},
-        (desc->physical_start - available_end) / kBytesPerFrame);
+        (desc.physical_start - available_end) / kBytesPerFrame);
     }
 
     const auto physical_end = 
-      desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-    if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+      desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+    if (IsAvailable(static_cast<MemoryType>(desc.type))) {
       available_end = physical_end;
     } else {
       memory_manager->MarkAllocated(
-        FrameID{desc->physical_start / kBytesPerFrame},
-        desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+        FrameID{desc.physical_start / kBytesPerFrame},
+        desc.number_of_pages * kUEFIPageSize / kBytesPerFrame);
     }
+  });
+  for (size_t i = 0; i < num_boot_frames; ++i) {
+    memory_manager->MarkAllocated(
+      FrameID{boot_frames[i].begin}, boot_frames[i].end - boot_frames[i].begin);
   }
-  memory_manager->SetMemoryRange(
-    FrameID{1}, FrameID{available_end / kBytesPerFrame});
-  
-  if (auto err = InitializeHeap(*memory_manager)) {
-    Log(kError, "failed to allocate pages: %s at %s:%d\n",
-        err.Name(), err.File(), err.Line());
-    exit(1);
-  }
+  memory_manager->MarkAllocated(FrameID{kAPTrampolineFrame}, 1);
+  memory_manager->SetMemoryRange(FrameID{1}, FrameID{frame_end});
 }
@@ -2,6 +2,9 @@
 
 #include <array>
 #include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
 
 #include "error.hpp"
 #include "memory_map.hpp"
@@ -49,19 +52,28 @@ struct MemoryStat {
  * The physical address of m-th bit of alloc_map[n] can be got by the
  * following formula.
  *  kFrameBytes * (n * kBitsPerMapLine + m)
+ *
+ * Free frames within the memory range are also kept in buddy free lists.
+ * A block of order k consists of 2^k frames aligned to 2^k frames,
+ * and its header (FreeBlock) is written into the first frame of the block.
+ * Allocate takes a block from the lists and splits it,
+ * and Free coalesces a released block with its buddy,
+ * so both run in O(kMaxOrder) instead of scanning the bitmap.
+ *
+ * The bitmap is read and written a line (64 frames) at a time.
+ * free_line_map_ is a summary level with one bit per line of alloc_map_,
+ * which is 1 when the line has at least one free frame, so that searches
+ * for free frames skip fully allocated lines.
+ *
+ * The bitmaps are not part of this class. They are sized for the frames
+ * the machine actually has and placed at boot by InitializeMemoryManager.
+ *
+ * A reference count per frame, stored after the bitmaps, records how many
+ * page table entries map the frame, so that a frame shared copy-on-write
+ * by several address spaces is freed when the last mapping goes away.
  */
 class BitmapMemoryManager {
   public:
-    /** @brief Maximum amount of physical memory
-     * this memory management class can handle (bytes)
-     */ 
-    static const auto kMaxPhysicalMemoryBytes{128_GiB};
-
-    /** @brief The number of frames required to handle physical memory
-     * up to kMaxPhysicalMemoryBytes
-     */
-    static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
-
     /** @brief Element type of bitmap array */
     using MapLineType = unsigned long;
 
@@ -70,7 +82,24 @@ class BitmapMemoryManager {
      */
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
-    BitmapMemoryManager();
+    /** @brief The order of the largest buddy block (2^18 frames = 1 GiB) */
+    static const int kMaxOrder{18};
+
+    /** @brief Reference count value that is never decremented */
+    static const uint16_t kPinnedRefCount{0xffff};
+
+    /** @brief Returns the size of the bitmaps and the reference counts
+     * needed to handle the frames below frame_end (bytes)
+     */
+    static size_t MapBytes(FrameID frame_end);
+
+    /** @brief Constructs a memory manager handling the frames below frame_end.
+     *
+     * @param frame_end The end of the frames this class can handle
+     * @param map_buf Storage for the bitmaps and the reference counts,
+     *   at least MapBytes(frame_end) bytes
+     */
+    BitmapMemoryManager(FrameID frame_end, void *map_buf);
 
     WithError<FrameID> Allocate(size_t num_frames);
     Error Free(FrameID start_frame, size_t num_frames);
@@ -79,20 +108,80 @@ class BitmapMemoryManager {
     /** @brief Sets the range of memory this memory manager class handles.
      * Since calling this method, 'Allocate' does memory allocation
      * within the range.
+     * Free frames in the range are gathered into the buddy free lists,
+     * so frames marked allocated before calling this method are excluded.
      */ 
     void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
     MemoryStat Stat() const;
+
+    uint16_t RefCount(FrameID frame) const;
+
+    /** @brief Increments the reference count of a frame.
+     * A count reaching kPinnedRefCount stays there.
+     */
+    void IncrementRefCount(FrameID frame);
+
+    /** @brief Decrements the reference count of a frame.
+     * @return The new count. The caller frees the frame when it is 0.
+     */
+    uint16_t DecrementRefCount(FrameID frame);
+
+    /** @brief Sets the reference count of a frame to kPinnedRefCount,
+     * so that unmapping the frame never frees it.
+     */
+    void PinFrame(FrameID frame);
   
   private:
-    std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    /** @brief Header of a free block, placed at the first frame of the block. */
+    struct FreeBlock {
+      FreeBlock *next;
+      FreeBlock *prev;
+      int order;
+    };
+
+    size_t frame_count_;
+    MapLineType *alloc_map_;
+    MapLineType *free_line_map_;
+    uint16_t *ref_counts_;
+    std::array<FreeBlock*, kMaxOrder + 1> free_lists_;
+    size_t free_frames_;
     FrameID range_begin_;
     FrameID range_end_;
 
     bool GetBit(FrameID frame) const;
     void SetBit(FrameID frame, bool allocated);
+    void SetBits(size_t begin, size_t end, bool allocated);
+    size_t FindFreeFrame(size_t begin, size_t end) const;
+    size_t FindAllocatedFrame(size_t begin, size_t end) const;
+
+    FreeBlock *BlockAt(size_t frame) const;
+    bool IsFreeBlock(size_t frame, int order) const;
+    void PushBlock(size_t frame, int order);
+    void RemoveBlock(FreeBlock *block);
+    void InsertBlock(size_t frame, int order);
+    void ReleaseRange(size_t begin, size_t end);
+    std::optional<size_t> FindBlock(size_t frame) const;
 };
 // #@@range_end(bitmap_memory_manager)
 
 extern BitmapMemoryManager *memory_manager;
 void InitializeMemoryManager(const MemoryMap &memory_map);
+
+/** @brief Calls f for each descriptor in memory_map. */
+template <class Func>
+void ForEachDescriptor(const MemoryMap &memory_map, Func f) {
+  const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+  for (uintptr_t iter = memory_map_base;
+       iter < memory_map_base + memory_map.map_size;
+       iter += memory_map.descriptor_size) {
+    f(*reinterpret_cast<const MemoryDescriptor*>(iter));
+  }
+}
+
+/** @brief Takes contiguous frames of conventional memory
+ * before memory_manager is set up.
+ * InitializeMemoryManager marks the frames taken so far as allocated.
+ */
+WithError<FrameID> AllocateBootFrames(const MemoryMap &memory_map,
+                                      size_t num_frames);
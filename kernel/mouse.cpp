@@ -4,6 +4,7 @@
 
 #include "graphics.hpp"
 #include "layer.hpp"
+#include "slab.hpp"
 #include "task.hpp"
 #include "usb/classdriver/mouse.hpp"
 
@@ -182,7 +183,7 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x,
 }
 
 void InitializeMouse() {
-  auto mouse_window = std::make_shared<Window>(
+  auto mouse_window = MakeSlabShared<Window>(
     kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
   mouse_window->SetTransparentColor(kMouseTransparentColor);
   DrawMouseCursor(mouse_window->Writer(), {0, 0});
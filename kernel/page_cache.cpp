@@ -0,0 +1,149 @@
+#include "page_cache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <utility>
+
+#include "slab.hpp"
+#include "zero_pool.hpp"
+
+namespace {
+  /** @brief Free frames below which a miss evicts idle pages first */
+  const size_t kLowFreeFrames = 2048;
+  /** @brief The number of idle pages a miss evicts at once */
+  const size_t kEvictBatch = 64;
+
+  struct CachedPage {
+    FrameID frame;
+    uint64_t last_use;
+  };
+
+  using Key = std::pair<const void*, size_t>; // file, page offset
+  using PageMap = std::map<Key, CachedPage, std::less<Key>,
+                           SlabAllocator<std::pair<const Key, CachedPage>>>;
+
+  PageMap *pages;
+  uint64_t use_clock = 0;
+  PageCacheStat stat{};
+
+  bool LowOnMemory() {
+    const auto m_stat = memory_manager->Stat();
+    return m_stat.total_frames - m_stat.allocated_frames < kLowFreeFrames;
+  }
+
+  void Drop(PageMap::iterator it) {
+    if (memory_manager->DecrementRefCount(it->second.frame) == 0) {
+      memory_manager->Free(it->second.frame, 1);
+    }
+    pages->erase(it);
+  }
+
+  WithError<FrameID> LoadPage(FileDescriptor &fd, size_t offset) {
+    if (LowOnMemory()) {
+      EvictPageCache(kEvictBatch);
+    }
+    auto frame = memory_manager->Allocate(1);
+    if (frame.error && EvictPageCache(kEvictBatch) > 0) {
+      frame = memory_manager->Allocate(1);
+    }
+    if (frame.error) {
+      return frame;
+    }
+
+    auto page = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    const auto loaded = fd.Load(page, kBytesPerFrame, offset);
+    memset(page + loaded, 0, kBytesPerFrame - loaded);
+    return frame;
+  }
+}
+
+WithError<FrameID> GetCachedPage(FileDescriptor &fd, size_t offset) {
+  const void *cache_key = fd.CacheKey();
+  if (cache_key == nullptr) {
+    auto [ frame, err ] = LoadPage(fd, offset);
+    if (!err) {
+      memory_manager->IncrementRefCount(frame);
+    }
+    return { frame, err };
+  }
+
+  const Key key{cache_key, offset};
+  if (auto it = pages->find(key); it != pages->end()) {
+    ++stat.hits;
+    it->second.last_use = ++use_clock;
+    memory_manager->IncrementRefCount(it->second.frame);
+    return { it->second.frame, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  ++stat.misses;
+  auto [ frame, err ] = LoadPage(fd, offset);
+  if (err) {
+    return { frame, err };
+  }
+  pages->insert({key, CachedPage{frame, ++use_clock}});
+  memory_manager->IncrementRefCount(frame); // for the cache
+  memory_manager->IncrementRefCount(frame); // for the caller
+  return { frame, MAKE_ERROR(Error::kSuccess) };
+}
+
+void InvalidatePageCache(const void *cache_key) {
+  auto it = pages->lower_bound(Key{cache_key, 0});
+  while (it != pages->end() && it->first.first == cache_key) {
+    Drop(it++);
+  }
+}
+
+size_t EvictPageCache(size_t num_frames) {
+  const size_t drained = DrainZeroPool(num_frames);
+  num_frames -= drained;
+
+  // Pages referenced only by the cache are not mapped by any task.
+  // Each pass keeps the least recently used idle pages of a batch in a
+  // max-heap on last_use, so eviction doesn't allocate.
+  auto newer = [](const PageMap::iterator &a, const PageMap::iterator &b) {
+    return a->second.last_use < b->second.last_use;
+  };
+  std::array<PageMap::iterator, kEvictBatch> oldest;
+
+  size_t evicted = 0;
+  while (evicted < num_frames) {
+    const size_t batch = std::min(num_frames - evicted, kEvictBatch);
+    size_t n = 0;
+    for (auto it = pages->begin(); it != pages->end(); ++it) {
+      if (memory_manager->RefCount(it->second.frame) != 1) {
+        continue;
+      }
+      if (n < batch) {
+        oldest[n++] = it;
+        std::push_heap(oldest.begin(), oldest.begin() + n, newer);
+      } else if (newer(it, oldest[0])) {
+        std::pop_heap(oldest.begin(), oldest.begin() + n, newer);
+        oldest[n - 1] = it;
+        std::push_heap(oldest.begin(), oldest.begin() + n, newer);
+      }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      Drop(oldest[i]);
+    }
+    evicted += n;
+    if (n < batch) {
+      break;
+    }
+  }
+  stat.evictions += evicted;
+  return drained + evicted;
+}
+
+void InitializePageCache() {
+  pages = new PageMap;
+}
+
+PageCacheStat GetPageCacheStat() {
+  auto s = stat;
+  s.pages = pages->size();
+  return s;
+}
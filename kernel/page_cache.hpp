@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+
+#include "error.hpp"
+#include "file.hpp"
+#include "memory_manager.hpp"
+
+struct PageCacheStat {
+  size_t pages;         // pages held by the cache
+  size_t hits, misses;  // lookups by GetCachedPage
+  size_t evictions;     // idle pages freed under memory pressure
+};
+
+/** @brief Creates the page cache. Call after the heap is initialized. */
+void InitializePageCache();
+
+/** @brief Returns the frame caching the page of fd at file offset.
+ *
+ * Pages are keyed by (FileDescriptor::CacheKey(), page offset), so
+ * every descriptor of a file shares them. On a miss the page is loaded
+ * into a new frame, evicting idle pages first if free memory is low.
+ *
+ * The cache holds one reference to each frame. The returned frame is
+ * counted once more for the caller, who must map it read-only since it
+ * is shared with other mappers. CR0.WP makes the kernel honor that too:
+ * a write through the mapping, by the app or by a syscall on its behalf,
+ * faults into CopyOnePage, which copies the frame because the cache's
+ * reference keeps its count above 1.
+ *
+ * @param offset A multiple of 4 KiB
+ */
+WithError<FrameID> GetCachedPage(FileDescriptor &fd, size_t offset);
+
+/** @brief Drops the pages of a file from the cache, for example because
+ * the file has been written. Tasks mapping them keep their frames.
+ */
+void InvalidatePageCache(const void *cache_key);
+
+/** @brief Frees up to num_frames frames: pre-zeroed frames of the zero
+ * pool first, then pages no task maps, least recently used first.
+ * @return The number of frames freed
+ */
+size_t EvictPageCache(size_t num_frames);
+
+PageCacheStat GetPageCacheStat();
@@ -1,12 +1,22 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cpuid.h>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
 #include "asmfunc.h"
 #include "error.hpp"
+#include "fat.hpp"
+#include "logger.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
+#include "reclaim.hpp"
+#include "smp.hpp"
+#include "swap.hpp"
+#include "zero_pool.hpp"
 #include "task.hpp"
 
 namespace {
@@ -14,40 +24,207 @@ namespace {
   const uint64_t kPageSize2M = 512 * kPageSize4K;
   const uint64_t kPageSize1G = 512 * kPageSize2M;
 
+  /** @brief How far below the stack pointer an app may touch the stack,
+   * enough for the red zone and a push of a large frame. */
+  const uint64_t kStackGrowSlack = 64 * 1024 + 256;
+
+  /** @brief Pages a fault swaps out at once when free memory is low */
+  const size_t kSwapOutBatch = 64;
+
+  /** @brief The smallest size of the identity map.
+   * MMIO regions such as PCI BARs may lie above the memory in the memory map.
+   */
+  const uint64_t kIdentityMapMinBytes = 64 * kPageSize1G;
+  /** @brief The largest size of the identity map, which is what
+   * PML4 entry 0 covers. The entries above are used by the kernel heap.
+   */
+  const uint64_t kIdentityMapMaxBytes = 512 * kPageSize1G;
+
+  const uint64_t kCR0WP = 1 << 16;
+  const uint64_t kCR4PGE = 1 << 7;
+  const uint64_t kCR4PCIDE = 1 << 17;
+  const uint64_t kCR3PCIDMask = 0xfff;
+  const int kNumPCIDs = 4096;
+  /** @brief The beginning of the upper half, where applications live */
+  const uint64_t kUserHalfBegin = 0xffff'8000'0000'0000;
+
   alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
-  alignas(kPageSize4K)
-    std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+  /** @brief PCIDs in use by address spaces. PCID 0 is for pml4_table. */
+  std::array<uint64_t, kNumPCIDs / 64> pcid_map{1};
+
+  bool SupportsPCID() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (ecx >> 17) & 1; // PCID
+  }
+
+  bool Supports1GiBPages() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x8000'0001, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (edx >> 26) & 1; // Page1GB
+  }
+
+  /** @brief Returns the size of the identity map (bytes, 1 GiB aligned). */
+  uint64_t IdentityMapBytes(const MemoryMap &memory_map) {
+    uint64_t end = kIdentityMapMinBytes;
+    ForEachDescriptor(memory_map, [&](const MemoryDescriptor &desc) {
+      end = std::max<uint64_t>(
+        end, desc.physical_start + desc.number_of_pages * kUEFIPageSize);
+    });
+    end = (end + kPageSize1G - 1) & ~(kPageSize1G - 1);
+    return std::min(end, kIdentityMapMaxBytes);
+  }
 } //namespace
 
-void SetupIdentityPageTable() {
+void SetupIdentityPageTable(const MemoryMap &memory_map) {
+  const size_t num_pdp_entries = IdentityMapBytes(memory_map) / kPageSize1G;
+
   pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
-  for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
-    pdp_table[i_pdpt] =
-      reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
-    for (int i_pd = 0; i_pd < 512; ++i_pd) {
-      page_directory[i_pdpt][i_pd] =
-        i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+  if (Supports1GiBPages()) {
+    for (int i_pdpt = 0; i_pdpt < num_pdp_entries; ++i_pdpt) {
+      pdp_table[i_pdpt] = i_pdpt * kPageSize1G | 0x183;
+    }
+  } else {
+    const auto [ pd_frame, err ] =
+      AllocateBootFrames(memory_map, num_pdp_entries);
+    if (err) {
+      Log(kError, "failed to allocate page directories: %s at %s:%d\n",
+          err.Name(), err.File(), err.Line());
+      exit(1);
+    }
+    auto page_directory =
+      reinterpret_cast<std::array<uint64_t, 512>*>(pd_frame.Frame());
+    for (int i_pdpt = 0; i_pdpt < num_pdp_entries; ++i_pdpt) {
+      pdp_table[i_pdpt] =
+        reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
+      for (int i_pd = 0; i_pd < 512; ++i_pd) {
+        page_directory[i_pdpt][i_pd] =
+          i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
+      }
     }
   }
 
   ResetCR3();
-  SetCR0(GetCR0() & 0xfffe'ffff); // Clear WP
+  // Read-only pages of applications are shared (file mappings, the page
+  // cache, app image templates), so the kernel must not write to them
+  // either: with WP set, its writes fault and get a copy as app writes do.
+  SetCR0(GetCR0() | kCR0WP);
 }
 
-void InitializePaging() {
-  SetupIdentityPageTable();
+void InitializePaging(const MemoryMap &memory_map) {
+  SetupIdentityPageTable(memory_map);
+
+  // Kernel mappings are global, so they stay in the TLB across CR3 loads.
+  SetCR4(GetCR4() | kCR4PGE);
+  if (SupportsPCID()) {
+    SetCR4(GetCR4() | kCR4PCIDE);
+    cr3_no_flush_bit = 1ul << 63;
+  }
 }
 
 void ResetCR3() {
-  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]) | cr3_no_flush_bit);
+}
+
+uint64_t cr3_no_flush_bit = 0;
+
+PageMapEntry *CurrentPML4() {
+  return reinterpret_cast<PageMapEntry*>(GetCR3() & ~kCR3PCIDMask);
+}
+
+WithError<uint64_t> NewCR3(PageMapEntry *pml4) {
+  const auto cr3 = reinterpret_cast<uint64_t>(pml4);
+  if (cr3_no_flush_bit == 0) {
+    return { cr3, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  for (int i = 0; i < pcid_map.size(); ++i) {
+    if (pcid_map[i] == ~0ul) {
+      continue;
+    }
+    const int bit = __builtin_ctzl(~pcid_map[i]);
+    pcid_map[i] |= 1ul << bit;
+    return { cr3 | (i * 64 + bit), MAKE_ERROR(Error::kSuccess) };
+  }
+  return { 0, MAKE_ERROR(Error::kFull) };
+}
+
+void ReleaseCR3(uint64_t cr3) {
+  const int pcid = cr3 & kCR3PCIDMask;
+  if (pcid != 0) {
+    pcid_map[pcid / 64] &= ~(1ul << (pcid % 64));
+  }
 }
 
 namespace {
 
-WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry &entry) {
+FrameID FrameOf(const PageMapEntry *p) {
+  return FrameID{reinterpret_cast<uintptr_t>(p) / kBytesPerFrame};
+}
+
+/** @brief Returns true if entry of a page map at page_map_level
+ * maps a 2 MiB page.
+ */
+bool IsHugePage(const PageMapEntry &entry, int page_map_level) {
+  return page_map_level == 2 && entry.bits.present && entry.bits.huge_page;
+}
+
+/** @brief Makes the page table entry points to private to the address
+ * space entry belongs to.
+ *
+ * Page tables of an application are shared between launches by
+ * CopyPageMaps. A table's reference count is the number of extra
+ * address spaces sharing it, and entries pointing to a shared table are
+ * read-only. A shared table is cloned here; the clone and the original
+ * then share every child, so the children are write-protected and
+ * their reference counts incremented.
+ */
+WithError<PageMapEntry*> UnshareChildMap(PageMapEntry &entry) {
+  auto child_map = entry.Pointer();
+  const auto child_frame = FrameOf(child_map);
+  if (memory_manager->RefCount(child_frame) > 0) {
+    auto [ copy, err ] = NewPageMap();
+    if (err) {
+      return { nullptr, err };
+    }
+    for (int i = 0; i < 512; ++i) {
+      if (!child_map[i].bits.present) {
+        continue;
+      }
+      child_map[i].bits.writable = 0;
+      copy[i] = child_map[i];
+      memory_manager->IncrementRefCount(FrameOf(child_map[i].Pointer()));
+    }
+    memory_manager->DecrementRefCount(child_frame);
+    entry.SetPointer(copy);
+    child_map = copy;
+    // Drop cached walks through the original, which the other users
+    // may free later. Reloading CR3 flushes them for the current PCID.
+    SetCR3(GetCR3());
+  }
+  entry.bits.writable = 1;
+  return { child_map, MAKE_ERROR(Error::kSuccess) };
+}
+
+/** @brief Returns the table entry points to, allocating it if entry isn't
+ * present and unsharing it if it is shared (see UnshareChildMap).
+ *
+ * @param child_level The level of the table, or 0 if entry is a leaf
+ *   whose page is allocated here
+ */
+WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry &entry,
+                                                   int child_level) {
   if (entry.bits.present) {
-    return { entry.Pointer(), MAKE_ERROR(Error::kSuccess) };
+    if (child_level == 0) {
+      return { entry.Pointer(), MAKE_ERROR(Error::kSuccess) };
+    }
+    return UnshareChildMap(entry);
   }
 
   auto [ child_map, err ] = NewPageMap();
@@ -61,6 +238,22 @@ WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry &entry) {
   return { child_map, MAKE_ERROR(Error::kSuccess) };
 }
 
+/** @brief Allocates a zeroed 2 MiB page and sets it to entry. */
+Error SetNewHugePage(PageMapEntry &entry) {
+  auto [ frame, err ] = memory_manager->Allocate(512);
+  if (err) {
+    return err;
+  }
+  memset(frame.Frame(), 0, kPageSize2M);
+  memory_manager->IncrementRefCount(frame);
+
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.huge_page = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 WithError<size_t> SetupPageMap(
     PageMapEntry *page_map,
     int page_map_level,
@@ -69,24 +262,48 @@ WithError<size_t> SetupPageMap(
     bool writable) {
   while (num_4kpages > 0) {
     const auto entry_index = addr.Part(page_map_level);
-
-    auto [ child_map, err ] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-    if (err) {
-      return { num_4kpages, err };
-    }
-    page_map[entry_index].bits.user = 1;
-
-    if (page_map_level == 1) {
-      page_map[entry_index].bits.writable = writable;
+    auto &entry = page_map[entry_index];
+
+    if (IsHugePage(entry, page_map_level)) {
+      // already mapped by a 2 MiB page
+      num_4kpages -= std::min<size_t>(num_4kpages, 512 - addr.Part(1));
+    } else if (page_map_level == 2 && !entry.bits.present &&
+               addr.Part(1) == 0 && num_4kpages >= 512 &&
+               !SetNewHugePage(entry)) {
+      // an aligned 2 MiB region is requested as a whole
+      entry.bits.user = 1;
+      entry.bits.writable = writable;
+      num_4kpages -= 512;
+    } else if (page_map_level == 1 && IsSwapEntry(entry)) {
+      if (auto err = SwapInPage(entry)) {
+        return { num_4kpages, err };
+      }
+      entry.bits.writable = writable;
       --num_4kpages;
     } else {
-      page_map[entry_index].bits.writable = true;
-      auto [ num_remain_pages, err ] =
-        SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+      const bool new_page = page_map_level == 1 && !entry.bits.present;
+      auto [ child_map, err ] =
+        SetNewPageMapIfNotPresent(entry, page_map_level - 1);
       if (err) {
         return { num_4kpages, err };
       }
-      num_4kpages = num_remain_pages;
+      entry.bits.user = 1;
+
+      if (page_map_level == 1) {
+        if (new_page) {
+          memory_manager->IncrementRefCount(FrameOf(child_map));
+        }
+        entry.bits.writable = writable;
+        --num_4kpages;
+      } else {
+        entry.bits.writable = true;
+        auto [ num_remain_pages, err ] =
+          SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+        if (err) {
+          return { num_4kpages, err };
+        }
+        num_4kpages = num_remain_pages;
+      }
     }
 
     if (entry_index == 511) {
@@ -104,90 +321,340 @@ WithError<size_t> SetupPageMap(
 
 Error CleanPageMap(
   PageMapEntry *page_map, int page_map_level, LinearAddress4Level addr) {
+  FrameBatch batch;
   for (int i = addr.Part(page_map_level); i < 512; ++i) {
-    auto entry = page_map[i];
+    if (auto err = ReleasePageMapEntry(page_map[i], page_map_level, batch)) {
+      batch.Flush();
+      return err;
+    }
+  }
+  batch.Flush();
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/** @brief Releases the page of a leaf entry, freeing it if no other
+ * address space maps it.
+ */
+Error ReleasePage(PageMapEntry &entry, bool huge) {
+  const auto frame = FrameOf(entry.Pointer());
+  entry.data = 0;
+  if (memory_manager->DecrementRefCount(frame) == 0) {
+    return memory_manager->Free(frame, huge ? 512 : 1);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+bool IsEmptyPageMap(const PageMapEntry *page_map) {
+  for (int i = 0; i < 512; ++i) {
+    if (page_map[i].bits.present || IsSwapEntry(page_map[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** @brief Unmaps num_4kpages pages from addr, freeing the page tables
+ * that become empty.
+ * @return The number of pages left beyond the end of page_map
+ */
+WithError<size_t> UnmapPageMap(
+    PageMapEntry *page_map, int page_map_level,
+    LinearAddress4Level addr, size_t num_4kpages) {
+  // the number of 4 KiB pages an entry of page_map covers
+  const size_t entry_pages = size_t{1} << (9 * (page_map_level - 1));
+
+  while (num_4kpages > 0) {
+    const auto entry_index = addr.Part(page_map_level);
+    auto &entry = page_map[entry_index];
+    const size_t pages_in_entry = std::min(
+        num_4kpages, entry_pages - (addr.value >> 12) % entry_pages);
+
     if (!entry.bits.present) {
-      continue;
+      if (IsSwapEntry(entry)) {
+        DropSwapEntry(entry);
+      }
+      num_4kpages -= pages_in_entry;
+    } else if (page_map_level == 1 || IsHugePage(entry, page_map_level)) {
+      if (pages_in_entry < entry_pages) {
+        // splitting a 2 MiB page isn't supported
+        return { num_4kpages, MAKE_ERROR(Error::kNotImplemented) };
+      }
+      if (auto err = ReleasePage(entry, page_map_level == 2)) {
+        return { num_4kpages, err };
+      }
+      InvalidateTLB(addr.value);
+      num_4kpages -= pages_in_entry;
+    } else {
+      auto [ child_map, err_unshare ] = UnshareChildMap(entry);
+      if (err_unshare) {
+        return { num_4kpages, err_unshare };
+      }
+      auto [ num_remain_pages, err ] =
+        UnmapPageMap(child_map, page_map_level - 1, addr, num_4kpages);
+      if (err) {
+        return { num_4kpages, err };
+      }
+      num_4kpages = num_remain_pages;
+      if (IsEmptyPageMap(child_map)) {
+        entry.data = 0;
+        InvalidateTLB(addr.value);
+        if (auto err = FreePageMap(child_map)) {
+          return { num_4kpages, err };
+        }
+      }
     }
 
-    if (page_map_level > 1) {
-      if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
-        return err;
+    if (entry_index == 511) {
+      break;
+    }
+
+    addr.SetPart(page_map_level, entry_index + 1);
+    for (int level = page_map_level - 1; level >= 1; --level) {
+      addr.SetPart(level, 0);
+    }
+  }
+
+  return { num_4kpages, MAKE_ERROR(Error::kSuccess) };
+}
+
+/** @brief Returns the mapping of maps (FileMappingMap or AnonMappingMap)
+ * containing causal_vaddr.
+ */
+template <class MappingMap>
+const typename MappingMap::mapped_type *FindMapping(const MappingMap &maps,
+                                                    uint64_t causal_vaddr) {
+  // Mappings don't overlap, so the first one ending beyond causal_vaddr
+  // is the only candidate.
+  auto it = maps.upper_bound(causal_vaddr);
+  if (it != maps.end() && it->second.vaddr_begin <= causal_vaddr) {
+    return &it->second;
+  }
+  return nullptr;
+}
+
+/** @brief Maps a read-only page at addr in pml4_table to frame.
+ * The caller accounts for the reference from the page table.
+ */
+Error MapReadOnlyPage(PageMapEntry *pml4_table,
+                      LinearAddress4Level addr, FrameID frame) {
+  auto table = pml4_table;
+  for (int level = 4; level > 1; --level) {
+    auto &entry = table[addr.Part(level)];
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, level - 1);
+    if (err) {
+      return err;
+    }
+    entry.bits.user = 1;
+    entry.bits.writable = 1;
+    table = child_map;
+  }
+
+  auto &entry = table[addr.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.user = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/** @brief Maps num_pages pages of a file mapping from page_vaddr.
+ *
+ * Pages whose content lies page-aligned and contiguous in the volume image
+ * are mapped to the image itself. Those frames are pinned, so they are
+ * never freed by CleanPageMap. The other pages come from the page cache.
+ * Either way the pages are shared, so they are mapped read-only and
+ * a write to them makes a private copy.
+ */
+Error PreparePageCache(FileDescriptor &fd, const FileMapping &m,
+                       uint64_t page_vaddr, size_t num_pages) {
+  const uint64_t end_vaddr = page_vaddr + num_pages * kPageSize4K;
+  while (page_vaddr < end_vaddr) {
+    const size_t file_offset = page_vaddr - m.vaddr_begin;
+    auto [ content, len ] =
+      fd.ContentExtent(file_offset, end_vaddr - page_vaddr);
+
+    if (content != 0 && content % kPageSize4K == 0 && len >= kPageSize4K) {
+      for (; len >= kPageSize4K; len -= kPageSize4K) {
+        const FrameID frame{content / kBytesPerFrame};
+        memory_manager->PinFrame(frame);
+        if (auto err = MapReadOnlyPage(CurrentPML4(),
+                                       LinearAddress4Level{page_vaddr}, frame)) {
+          return err;
+        }
+        content += kPageSize4K;
+        page_vaddr += kPageSize4K;
       }
+      continue;
     }
-    
-    if (entry.bits.writable) {
-      const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-      const FrameID map_frame{entry_addr / kBytesPerFrame};
-      if (auto err = memory_manager->Free(map_frame, 1)) {
-        return err;
+
+    auto [ frame, err ] = GetCachedPage(fd, file_offset);
+    if (err) {
+      return err;
+    }
+    if (auto err = MapReadOnlyPage(CurrentPML4(),
+                                   LinearAddress4Level{page_vaddr}, frame)) {
+      if (memory_manager->DecrementRefCount(frame) == 0) {
+        memory_manager->Free(frame, 1);
       }
+      return err;
     }
-    page_map[i].data = 0;
+    page_vaddr += kPageSize4K;
   }
-
   return MAKE_ERROR(Error::kSuccess);
 }
 
-const FileMapping *FindFileMapping(const std::vector<FileMapping> &fmaps,
-                                   uint64_t causal_vaddr) {
-  for (const FileMapping &m : fmaps) {
-    if (m.vaddr_begin <= causal_vaddr && causal_vaddr < m.vaddr_end) {
-      return &m;
+/** @brief Returns the page table entry mapping addr,
+ * which is at level 2 for a 2 MiB page and level 1 for a 4 KiB page.
+ * Returns nullptr if no page table exists for addr.
+ */
+PageMapEntry *FindPageEntry(PageMapEntry *pml4_table, LinearAddress4Level addr) {
+  auto table = pml4_table;
+  for (int level = 4; level > 1; --level) {
+    auto &entry = table[addr.Part(level)];
+    if (!entry.bits.present) {
+      return nullptr;
+    }
+    if (level == 2 && entry.bits.huge_page) {
+      return &entry;
     }
+    table = entry.Pointer();
   }
-  return nullptr;
+  return &table[addr.Part(1)];
 }
 
-Error PreparePageCache(FileDescriptor &fd, const FileMapping &m,
-                       uint64_t causal_vaddr) {
-  LinearAddress4Level page_vaddr{causal_vaddr};
-  page_vaddr.parts.offset = 0;
-  if (auto err = SetupPageMaps(page_vaddr, 1)) {
-    return err;
+/** @brief Returns the page table entry mapping addr like FindPageEntry,
+ * unsharing the tables on the way so that the entry belongs to
+ * this address space only.
+ */
+WithError<PageMapEntry*> FindOwnedPageEntry(PageMapEntry *pml4_table,
+                                            LinearAddress4Level addr) {
+  auto table = pml4_table;
+  for (int level = 4; level > 1; --level) {
+    auto &entry = table[addr.Part(level)];
+    if (!entry.bits.present) {
+      return { nullptr, MAKE_ERROR(Error::kIndexOutOfRange) };
+    }
+    if (level == 2 && entry.bits.huge_page) {
+      return { &entry, MAKE_ERROR(Error::kSuccess) };
+    }
+    auto [ child_map, err ] = UnshareChildMap(entry);
+    if (err) {
+      return { nullptr, err };
+    }
+    table = child_map;
   }
+  return { &table[addr.Part(1)], MAKE_ERROR(Error::kSuccess) };
+}
 
-  const long file_offset = page_vaddr.value - m.vaddr_begin;
-  void *page_cache = reinterpret_cast<void*>(page_vaddr.value);
-  fd.Load(page_cache, 4096, file_offset);
-  return MAKE_ERROR(Error::kSuccess);
+const LoadSegment *FindLoadSegment(const AppImage &image, uint64_t addr) {
+  for (const auto &seg : image.segments) {
+    const uint64_t begin = seg.vaddr & ~(kPageSize4K - 1);
+    const uint64_t end =
+      (seg.vaddr + seg.mem_bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    if (begin <= addr && addr < end) {
+      return &seg;
+    }
+  }
+  return nullptr;
 }
 
-Error SetPageContent(PageMapEntry *table, int part,
-                     LinearAddress4Level addr, PageMapEntry *content) {
-  if (part == 1) {
-    const auto i = addr.Part(part);
-    table[i].SetPointer(content);
-    table[i].bits.writable = 1;
-    InvalidateTLB(addr.value);
-    return MAKE_ERROR(Error::kSuccess);
+/** @brief Fills a zeroed page at page_addr with the file content of
+ * the segments overlapping it.
+ */
+void FillImagePage(const AppImage &image, uint64_t page_addr, uint8_t *page) {
+  fat::FileDescriptor fd{*image.file};
+  for (const auto &seg : image.segments) {
+    const uint64_t begin = std::max(seg.vaddr, page_addr);
+    const uint64_t end = std::min(seg.vaddr + seg.file_bytes,
+                                  page_addr + kPageSize4K);
+    if (begin < end) {
+      fd.Load(page + (begin - page_addr), end - begin,
+              seg.file_offset + (begin - seg.vaddr));
+    }
   }
+}
+
+/** @brief Maps num_pages pages of the application image from page_addr,
+ * loading the pages the template doesn't have yet.
+ */
+Error LoadImagePages(const AppImage &image, uint64_t page_addr,
+                     size_t num_pages) {
+  for (size_t i = 0; i < num_pages; ++i, page_addr += kPageSize4K) {
+    const LinearAddress4Level addr{page_addr};
+    auto entry = FindPageEntry(image.template_pml4, addr);
+    FrameID frame = kNullFrame;
+    if (entry && entry->bits.present) {
+      frame = FrameOf(entry->Pointer());
+    } else {
+      auto [ new_frame, err ] = AllocateZeroedFrame();
+      if (err) {
+        return err;
+      }
+      frame = new_frame;
+      auto page = reinterpret_cast<uint8_t*>(frame.Frame());
+      FillImagePage(image, page_addr, page);
+      if (auto err = MapReadOnlyPage(image.template_pml4, addr, frame)) {
+        memory_manager->Free(frame, 1);
+        return err;
+      }
+      memory_manager->IncrementRefCount(frame);
+    }
 
-  const auto i = addr.Part(part);
-  return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+    if (auto err = MapReadOnlyPage(CurrentPML4(), addr, frame)) {
+      return err;
+    }
+    memory_manager->IncrementRefCount(frame);
+  }
+  return MAKE_ERROR(Error::kSuccess);
 }
 
+
+/** @brief Makes the read-only page at causal_addr writable.
+ * The page is copied unless this address space is its only user.
+ */
 Error CopyOnePage(uint64_t causal_addr) {
-  auto [ p, err ] = NewPageMap();
+  auto [ entry, err ] =
+    FindOwnedPageEntry(CurrentPML4(), LinearAddress4Level{causal_addr});
   if (err) {
     return err;
   }
-  const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-  memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-  return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4,
-                        LinearAddress4Level{causal_addr}, p);
+  if (!entry->bits.present) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  const auto frame = FrameOf(entry->Pointer());
+  if (memory_manager->RefCount(frame) != 1) {
+    const uint64_t page_size = entry->bits.huge_page ? kPageSize2M : kPageSize4K;
+    auto [ copy, err ] = memory_manager->Allocate(page_size / kBytesPerFrame);
+    if (err) {
+      return err;
+    }
+    const auto aligned_addr = causal_addr & ~(page_size - 1);
+    memcpy(copy.Frame(), reinterpret_cast<const void*>(aligned_addr), page_size);
+    memory_manager->IncrementRefCount(copy);
+    memory_manager->DecrementRefCount(frame);
+    entry->SetPointer(reinterpret_cast<PageMapEntry*>(copy.Frame()));
+  }
+  entry->bits.writable = 1;
+  // The entry belongs to this address space only,
+  // so invalidating it for the current PCID is enough.
+  InvalidateTLB(causal_addr);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+PageMapEntry *FindKernelPageEntry(LinearAddress4Level addr) {
+  return FindPageEntry(reinterpret_cast<PageMapEntry*>(pml4_table.data()), addr);
 }
 
 } // namespace
 
 WithError<PageMapEntry*> NewPageMap() {
-  auto frame = memory_manager->Allocate(1);
+  auto frame = AllocateZeroedFrame();
   if (frame.error) {
     return { nullptr, frame.error };
   }
 
   auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-  memset(e, 0, sizeof(uint64_t) * 512);
   return { e, MAKE_ERROR(Error::kSuccess) };
 }
 
@@ -198,60 +665,257 @@ Error FreePageMap(PageMapEntry* table) {
 
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  auto pml4_table = CurrentPML4();
   return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
 Error CleanPageMaps(LinearAddress4Level addr) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  auto pml4_table = CurrentPML4();
   return CleanPageMap(pml4_table, 4, addr);
 }
 
-Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start) {
-  if (part == 1) {
-    for (int i = start; i < 512; ++i) {
-      if (!src[i].bits.present) {
-        continue;
-      }
-      dest[i] = src[i];
-      dest[i].bits.writable = 0;
+Error ReleasePageMapEntry(PageMapEntry &entry, int page_map_level,
+                          FrameBatch &batch) {
+  if (!entry.bits.present) {
+    if (IsSwapEntry(entry)) {
+      DropSwapEntry(entry);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  const bool huge = IsHugePage(entry, page_map_level);
+  const auto map_frame = FrameOf(entry.Pointer());
+  const bool page = page_map_level == 1 || huge;
+  if (!page) {
+    // A table shared with other address spaces just loses a reference.
+    if (memory_manager->RefCount(map_frame) > 0) {
+      memory_manager->DecrementRefCount(map_frame);
+      entry.data = 0;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    auto child_map = entry.Pointer();
+    for (int i = 0; i < 512; ++i) {
+      if (auto err = ReleasePageMapEntry(child_map[i], page_map_level - 1, batch)) {
+        return err;
+      }
+    }
+  }
+
+  // A page is freed when no address space maps it any more,
+  // a table is freed here since this address space is its only user.
+  if (!page || memory_manager->DecrementRefCount(map_frame) == 0) {
+    batch.Add(map_frame, huge ? 512 : 1);
+  }
+  entry.data = 0;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages) {
+  return UnmapPageMap(CurrentPML4(), 4, addr, num_4kpages).error;
+}
+
+Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start) {
+  // Tables and pages under src are shared, not copied. They are cloned
+  // by UnshareChildMap and CopyOnePage when either side modifies them.
   for (int i = start; i < 512; ++i) {
     if (!src[i].bits.present) {
       continue;
     }
-    auto [ table, err ] = NewPageMap();
-    if (err) {
-      return err;
-    }
+    src[i].bits.writable = 0;
     dest[i] = src[i];
-    dest[i].SetPointer(table);
-    if (auto err = CopyPageMaps(table, src[i].Pointer(), part - 1, 0)) {
-      return err;
-    }
+    memory_manager->IncrementRefCount(FrameOf(src[i].Pointer()));
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+size_t fault_around_max_pages = 16;
+size_t app_stack_max_pages = 256;
+
+namespace {
+  FaultAroundStat fault_around_stat{};
+
+  /** @brief Counts the consecutive pages from addr that aren't mapped,
+   * up to max_pages.
+   */
+  size_t CountUnmappedPages(PageMapEntry *pml4_table, uint64_t addr,
+                            size_t max_pages) {
+    size_t n = 0;
+    for (; n < max_pages; ++n) {
+      auto entry = FindPageEntry(
+          pml4_table, LinearAddress4Level{addr + n * kPageSize4K});
+      // Swapped out pages come back through SwapInPage only.
+      if (entry && (entry->bits.present || IsSwapEntry(*entry))) {
+        break;
+      }
+    }
+    return n;
+  }
+
+  /** @brief Returns the number of pages to map for a fault on page_addr
+   * in a region ending at region_end, and updates the fault-around state.
+   */
+  size_t FaultAroundPages(FaultAroundState &fa,
+                          uint64_t page_addr, uint64_t region_end) {
+    if (page_addr == fa.next_addr) {
+      // every page mapped ahead by the last fault has been used
+      fault_around_stat.saved_faults += fa.last_pages - 1;
+      fa.window_pages = std::min(fa.window_pages * 2, fault_around_max_pages);
+    } else {
+      fa.window_pages = 1;
+    }
+    fa.window_pages = std::max<size_t>(fa.window_pages, 1);
+
+    const size_t region_pages =
+      (region_end - page_addr + kPageSize4K - 1) / kPageSize4K;
+    const size_t num_pages = CountUnmappedPages(
+        CurrentPML4(), page_addr, std::min(fa.window_pages, region_pages));
+    fa.next_addr = page_addr + num_pages * kPageSize4K;
+    fa.last_pages = num_pages;
+
+    ++fault_around_stat.faults;
+    fault_around_stat.mapped_pages += num_pages;
+    return num_pages;
+  }
+}
+
+FaultAroundStat GetFaultAroundStat() {
+  return fault_around_stat;
+}
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr, uint64_t rsp) {
   auto &task = task_manager->CurrentTask();
   const bool present = (error_code >> 0) & 1;
   const bool rw      = (error_code >> 1) & 1;
   const bool user    = (error_code >> 2) & 1;
-  if (present && rw && user) {
+  if (present && rw && (user || causal_addr >= kUserHalfBegin)) {
+    // Includes syscalls writing to app buffers in read-only pages.
     return CopyOnePage(causal_addr);
   } else if (present) {
     return MAKE_ERROR(Error::kAlreadyAllocated);
   }
 
+  // Pre-zeroed frames go back before app pages are compressed.
+  auto m_stat = memory_manager->Stat();
+  if (const size_t free_frames = m_stat.total_frames - m_stat.allocated_frames;
+      free_frames < swap_low_free_frames) {
+    DrainZeroPool(swap_low_free_frames - free_frames);
+    m_stat = memory_manager->Stat();
+  }
+  if (m_stat.total_frames - m_stat.allocated_frames < swap_low_free_frames) {
+    SwapOutColdPages(CurrentPML4(), kSwapOutBatch);
+  }
+
+  const uint64_t page_addr = causal_addr & ~(kPageSize4K - 1);
+  if (auto entry = FindPageEntry(CurrentPML4(), LinearAddress4Level{page_addr});
+      entry && IsSwapEntry(*entry)) {
+    return SwapInPage(*entry);
+  }
+  if (auto image = task.Image()) {
+    if (auto seg = FindLoadSegment(*image, causal_addr)) {
+      const uint64_t seg_end = seg->vaddr + seg->mem_bytes;
+      const auto num_pages =
+        FaultAroundPages(task.FaultAround(), page_addr, seg_end);
+      return LoadImagePages(*image, page_addr, num_pages);
+    }
+  }
+  if (task.StackLimit() <= causal_addr && causal_addr < task.StackBegin()) {
+    // Accesses far below the stack pointer of the app are stray pointers.
+    // Faults in the kernel (syscalls writing to app buffers) have
+    // the kernel stack pointer, so they aren't checked.
+    if (user && causal_addr + kStackGrowSlack < rsp) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    const auto num_pages = (task.StackBegin() - page_addr) / kPageSize4K;
+    if (auto err = SetupPageMaps(LinearAddress4Level{page_addr}, num_pages)) {
+      return err;
+    }
+    task.SetStackBegin(page_addr);
+    return MAKE_ERROR(Error::kSuccess);
+  }
   if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-    return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+    // Map the whole 2 MiB region around the fault
+    // if it lies within the demand paging area.
+    const uint64_t huge_begin = causal_addr & ~(kPageSize2M - 1);
+    if (task.DPagingBegin() <= huge_begin &&
+        huge_begin + kPageSize2M <= task.DPagingEnd()) {
+      return SetupPageMaps(LinearAddress4Level{huge_begin}, 512);
+    }
+    const auto num_pages =
+      FaultAroundPages(task.FaultAround(), page_addr, task.DPagingEnd());
+    return SetupPageMaps(LinearAddress4Level{page_addr}, num_pages);
   }
-  if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-    return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+  if (auto m = FindMapping(task.AnonMaps(), causal_addr)) {
+    const uint64_t huge_begin = causal_addr & ~(kPageSize2M - 1);
+    if (m->huge && m->vaddr_begin <= huge_begin &&
+        huge_begin + kPageSize2M <= m->vaddr_end) {
+      return SetupPageMaps(LinearAddress4Level{huge_begin}, 512);
+    }
+    const auto num_pages =
+      FaultAroundPages(task.FaultAround(), page_addr, m->vaddr_end);
+    return SetupPageMaps(LinearAddress4Level{page_addr}, num_pages);
+  }
+  if (auto m = FindMapping(task.FileMaps(), causal_addr)) {
+    const auto num_pages =
+      FaultAroundPages(task.FaultAround(), page_addr, m->vaddr_end);
+    return PreparePageCache(*task.Files()[m->fd], *m, page_addr, num_pages);
   }
   return MAKE_ERROR(Error::kIndexOutOfRange);
 }
+
+Error MapKernelPage(LinearAddress4Level addr, bool huge) {
+  const int leaf_level = huge ? 2 : 1;
+  auto table = reinterpret_cast<PageMapEntry*>(pml4_table.data());
+  for (int level = 4; level > leaf_level; --level) {
+    auto &entry = table[addr.Part(level)];
+    if (entry.bits.present && entry.bits.huge_page) {
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry, level - 1);
+    if (err) {
+      return err;
+    }
+    entry.bits.writable = 1;
+    table = child_map;
+  }
+
+  auto &entry = table[addr.Part(leaf_level)];
+  if (entry.bits.present) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  auto [ frame, err ] = memory_manager->Allocate(huge ? 512 : 1);
+  if (err) {
+    return err;
+  }
+
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  entry.bits.huge_page = huge;
+  entry.bits.global = 1;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapKernelPage(LinearAddress4Level addr) {
+  auto entry = FindKernelPageEntry(addr);
+  if (entry == nullptr || !entry->bits.present) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  const bool huge = entry->bits.huge_page;
+  const auto frame = FrameOf(entry->Pointer());
+  entry->data = 0;
+  // The page is global, so this invalidates it for every PCID.
+  // Other processors flush it before they next run kernel code.
+  InvalidateTLB(addr.value);
+  NotifyKernelUnmap();
+  return memory_manager->Free(frame, huge ? 512 : 1);
+}
+
+size_t KernelPageBytes(LinearAddress4Level addr) {
+  auto entry = FindKernelPageEntry(addr);
+  if (entry == nullptr || !entry->bits.present) {
+    return 0;
+  }
+  return entry->bits.huge_page ? kPageSize2M : kPageSize4K;
+}
@@ -4,21 +4,22 @@
 #include <cstddef>
 
 #include "error.hpp"
-
-/** @brief The number of page directories to be statically allocated
- * 
- * This constant is used in SetUpIdentityPageTable.
- * Since one page directory can have 512 2MiB pages,
- * kPageDirectoryCount x 1GiB virtual addresses will be mapped.
- */
-const size_t kPageDirectoryCount = 64;
+#include "memory_map.hpp"
 
 /** @brief Sets the page table so that virtual address == physical address.
  *  Finally, the CR3 register points to the correctly set page table.
+ *
+ * The identity map covers every region in memory_map and at least 64 GiB.
+ * It is built from 1 GiB pages if the CPU supports them.
+ * Otherwise 2 MiB pages are used, and their page directories are taken
+ * from conventional memory with AllocateBootFrames.
  */
-void SetupIdentityPageTable();
+void SetupIdentityPageTable(const MemoryMap &memory_map);
 
-void InitializePaging();
+/** @brief Sets up the identity map and enables global pages,
+ * and PCIDs if the CPU supports them.
+ */
+void InitializePaging(const MemoryMap &memory_map);
 void ResetCR3();
 
 union LinearAddress4Level {
@@ -85,8 +86,103 @@ union PageMapEntry {
 
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry *table);
+
+/** @brief Bit 63 of CR3 if PCIDs are enabled, 0 otherwise.
+ * ORed into a CR3 value, it keeps the TLB entries of the PCID.
+ */
+extern "C" uint64_t cr3_no_flush_bit;
+
+/** @brief Returns the PML4 table CR3 currently points to. */
+PageMapEntry *CurrentPML4();
+
+/** @brief Returns the CR3 value for switching to pml4,
+ * tagged with a newly assigned PCID if PCIDs are enabled.
+ *
+ * The first load of the value must be done without cr3_no_flush_bit
+ * to drop what an earlier owner of the PCID left in the TLB.
+ */
+WithError<uint64_t> NewCR3(PageMapEntry *pml4);
+
+/** @brief Releases the PCID of a CR3 value obtained by NewCR3. */
+void ReleaseCR3(uint64_t cr3);
+
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
+
+class FrameBatch;
+
+/** @brief Releases what entry of a page map at page_map_level points to
+ * and clears the entry.
+ *
+ * Pages no other address space maps, and tables along with
+ * everything under them, are added to batch to be freed.
+ * Tables shared with other address spaces lose a reference only.
+ */
+Error ReleasePageMapEntry(PageMapEntry &entry, int page_map_level,
+                          FrameBatch &batch);
+
+/** @brief Unmaps num_4kpages pages from addr in the current address space.
+ * Pages no other address space maps are freed, and so are page tables
+ * left without entries.
+ */
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
+
 Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start);
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+struct FaultAroundStat {
+  size_t faults;       // faults that mapped new pages
+  size_t mapped_pages; // pages mapped by those faults
+  size_t saved_faults; // faults avoided by pages mapped ahead
+};
+
+/** @brief The largest number of pages a fault on a demand paging area or
+ * a file mapping maps at once. 1 disables fault-around.
+ */
+extern size_t fault_around_max_pages;
+
+FaultAroundStat GetFaultAroundStat();
+
+/** @brief The top of application stacks. The argument page lies above it. */
+const uint64_t kAppStackTop = 0xffff'ffff'ffff'f000;
+
+/** @brief Pages an application stack starts with */
+const size_t kAppStackInitialPages = 2;
+
+/** @brief The maximum size of an application stack in pages */
+extern size_t app_stack_max_pages;
+
+/** @brief Handles a page fault of the current task.
+ *
+ * A fault on a demand paging area, an anonymous mapping or a file mapping
+ * maps the faulting page along with the unmapped pages following it
+ * (fault-around). The number of pages doubles, up to
+ * fault_around_max_pages, while faults are sequential and falls back to
+ * 1 page on a random fault. Anonymous mappings preferring huge pages get
+ * a 2 MiB page if the 2 MiB region around the fault lies within them.
+ *
+ * A fault between the stack limit and the mapped stack grows the stack
+ * down to the faulting page if the access is near rsp, the stack pointer
+ * at the fault. The page below the stack limit is never mapped and
+ * catches overflows.
+ */
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr, uint64_t rsp);
+
+/** @brief Maps a newly allocated page to addr in the kernel page table.
+ *
+ * The page is 2 MiB if huge is true, 4 KiB otherwise.
+ * The kernel page table (PML4 entries 0 to 255) is shared with every
+ * application, so the mapping is visible whichever CR3 is loaded
+ * as long as the PML4 entry for addr existed before the application started.
+ */
+Error MapKernelPage(LinearAddress4Level addr, bool huge);
+
+/** @brief Unmaps the page containing addr from the kernel page table
+ * and frees its frames.
+ */
+Error UnmapKernelPage(LinearAddress4Level addr);
+
+/** @brief Returns the size of the kernel page containing addr (bytes),
+ * or 0 if addr isn't mapped.
+ */
+size_t KernelPageBytes(LinearAddress4Level addr);
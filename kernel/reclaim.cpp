@@ -0,0 +1,116 @@
+#include "reclaim.hpp"
+
+#include <algorithm>
+#include <deque>
+
+#include "logger.hpp"
+#include "task.hpp"
+
+namespace {
+  /** @brief Frames the reclaim task frees with interrupts disabled at once */
+  const size_t kReclaimBatchFrames = 4096;
+
+  std::deque<PageMapEntry*> reclaim_queue;
+  Task *reclaim_task = nullptr;
+  ReclaimStat stat{};
+
+  void FlushBatch(FrameBatch &batch) {
+    stat.frames += batch.Frames();
+    stat.free_calls += batch.Flush();
+  }
+
+  /** @brief Frees the user half of pml4_table and the table itself.
+   *
+   * Each PML4 entry is released with interrupts disabled, since page
+   * faults of other tasks update the same reference counts, and
+   * the collected frames are freed whenever the batch grows large.
+   */
+  void ReclaimOne(PageMapEntry *pml4_table) {
+    FrameBatch batch;
+    for (int i = 256; i < 512; ++i) {
+      __asm__("cli");
+      if (auto err = ReleasePageMapEntry(pml4_table[i], 4, batch)) {
+        Log(kError, "failed to reclaim a page map: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+      }
+      if (batch.Frames() >= kReclaimBatchFrames) {
+        FlushBatch(batch);
+      }
+      __asm__("sti");
+    }
+
+    __asm__("cli");
+    const auto pml4_frame = reinterpret_cast<uintptr_t>(pml4_table) / kBytesPerFrame;
+    batch.Add(FrameID{pml4_frame}, 1);
+    FlushBatch(batch);
+    ++stat.spaces;
+    __asm__("sti");
+  }
+
+  void TaskReclaim(uint64_t task_id, int64_t data) {
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    while (true) {
+      __asm__("cli");
+      if (reclaim_queue.empty()) {
+        task.Sleep();
+        __asm__("sti");
+        continue;
+      }
+      auto pml4_table = reclaim_queue.front();
+      reclaim_queue.pop_front();
+      __asm__("sti");
+
+      ReclaimOne(pml4_table);
+    }
+  }
+} // namespace
+
+void FrameBatch::Add(FrameID frame, size_t num_frames) {
+  runs_.push_back({frame.ID(), num_frames});
+  num_frames_ += num_frames;
+}
+
+size_t FrameBatch::Flush() {
+  std::sort(runs_.begin(), runs_.end(),
+            [](const Run &a, const Run &b) { return a.begin < b.begin; });
+
+  size_t num_calls = 0;
+  for (size_t i = 0; i < runs_.size();) {
+    size_t begin = runs_[i].begin, end = begin + runs_[i].num_frames;
+    for (++i; i < runs_.size() && runs_[i].begin == end; ++i) {
+      end += runs_[i].num_frames;
+    }
+    memory_manager->Free(FrameID{begin}, end - begin);
+    ++num_calls;
+  }
+
+  runs_.clear();
+  num_frames_ = 0;
+  return num_calls;
+}
+
+void InitializeReclaim() {
+  reclaim_task = &task_manager->NewTask()
+    .InitContext(TaskReclaim, 0);
+  __asm__("cli");
+  task_manager->Wakeup(reclaim_task, 0);
+  __asm__("sti");
+}
+
+void ReclaimPageMap(PageMapEntry *pml4_table) {
+  __asm__("cli");
+  reclaim_queue.push_back(pml4_table);
+  task_manager->Wakeup(reclaim_task);
+  __asm__("sti");
+}
+
+ReclaimStat GetReclaimStat() {
+  __asm__("cli");
+  auto s = stat;
+  s.pending_spaces = reclaim_queue.size();
+  __asm__("sti");
+  return s;
+}
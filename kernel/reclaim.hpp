@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+/** @brief Frames to be freed together.
+ *
+ * Flush sorts the collected frames and frees each run of adjacent frames
+ * with a single memory_manager->Free, which hands it to the buddy free
+ * lists as whole blocks.
+ */
+class FrameBatch {
+  public:
+    void Add(FrameID frame, size_t num_frames);
+
+    /** @brief Frees the collected frames.
+     * @return The number of Free calls made
+     */
+    size_t Flush();
+
+    size_t Frames() const { return num_frames_; }
+
+  private:
+    struct Run {
+      size_t begin, num_frames;
+    };
+    std::vector<Run> runs_;
+    size_t num_frames_{0};
+};
+
+struct ReclaimStat {
+  size_t pending_spaces; // address spaces waiting for the reclaim task
+  size_t spaces;         // address spaces freed so far
+  size_t frames;         // frames freed by the reclaim task
+  size_t free_calls;     // memory_manager->Free calls to free them
+};
+
+/** @brief Starts the reclaim task, which frees the address spaces of
+ * exited applications at the lowest task level.
+ */
+void InitializeReclaim();
+
+/** @brief Queues the page map of an exited application to be freed.
+ *
+ * The user half (PML4 entries 256 to 511) and the PML4 table itself are
+ * freed by the reclaim task later. The page map must not be loaded
+ * in CR3 any more.
+ */
+void ReclaimPageMap(PageMapEntry *pml4_table);
+
+ReclaimStat GetReclaimStat();
@@ -8,14 +8,15 @@
 #include "memory_manager.hpp"
 
 namespace {
-  std::array<SegmentDescriptor, 7> gdt;
-  std::array<uint32_t, 26> tss;
+  // 5 segments followed by a TSS descriptor (2 entries) per processor
+  std::array<SegmentDescriptor, 5 + 2 * kMaxCPUs> gdt;
+  std::array<std::array<uint32_t, 26>, kMaxCPUs> tss;
 
-  static_assert((kTSS >> 3) + 1 < gdt.size());
+  static_assert((TSSSelector(kMaxCPUs - 1) >> 3) + 1 < gdt.size());
 
-  void SetTSS(int index, uint64_t value) {
-    tss[index]     = value & 0xffff'ffff;
-    tss[index + 1] = value >> 32;
+  void SetTSS(int cpu, int index, uint64_t value) {
+    tss[cpu][index]     = value & 0xffff'ffff;
+    tss[cpu][index + 1] = value >> 32;
   }
 
   uint64_t AllocateStackArea(int num_4kframes) {
@@ -89,14 +90,25 @@ void InitializeSegmentation() {
   SetCSSS(kKernelCS, kKernelSS);
 }
 
-void InitializeTSS() {
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
+void SetupTSS(int cpu) {
+  SetTSS(cpu, 1, AllocateStackArea(8));
+  SetTSS(cpu, 7 + 2 * kISTForTimer, AllocateStackArea(8));
 
-  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-  SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
-                   tss_addr & 0xffff'ffff, sizeof(tss)-1);
-  gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+  const uint16_t sel = TSSSelector(cpu);
+  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[cpu][0]);
+  SetSystemSegment(gdt[sel >> 3], DescriptorType::kTSSAvailable, 0,
+                   tss_addr & 0xffff'ffff, sizeof(tss[cpu])-1);
+  gdt[(sel >> 3) + 1].data = tss_addr >> 32;
+}
 
+void InitializeTSS() {
+  SetupTSS(0);
   LoadTR(kTSS);
 }
+
+void LoadSegmentsOnAP(int cpu) {
+  LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+  SetDSAll(kKernelDS);
+  SetCSSS(kKernelCS, kKernelSS);
+  LoadTR(TSSSelector(cpu));
+}
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 
+#include "smp.hpp"
 #include "x86_descriptor.hpp"
 
 union SegmentDescriptor {
@@ -40,6 +41,23 @@ const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 const uint16_t kTSS = 5 << 3;
 
+/** @brief Returns the selector of the TSS of a processor.
+ * The bootstrap processor uses kTSS.
+ */
+constexpr uint16_t TSSSelector(int cpu) {
+  return kTSS + (cpu << 4);
+}
+
 void SetupSegments();
 void InitializeSegmentation();
 void InitializeTSS();
+
+/** @brief Allocates the stacks of the TSS of a processor and sets up
+ * its descriptor in the GDT.
+ */
+void SetupTSS(int cpu);
+
+/** @brief Loads the GDT, segment registers and the TSS of cpu on an
+ * application processor.
+ */
+void LoadSegmentsOnAP(int cpu);
@@ -0,0 +1,183 @@
+#include "slab.hpp"
+
+#include <array>
+#include <cstdlib>
+
+#include "logger.hpp"
+
+namespace {
+  SlabCache *slab_caches = nullptr;
+
+  /** @brief Caches for SlabAllocate, one per power of two from 16 bytes */
+  std::array<SlabCache, 9> size_caches{{
+    {"size-16", 16}, {"size-32", 32}, {"size-64", 64},
+    {"size-128", 128}, {"size-256", 256}, {"size-512", 512},
+    {"size-1024", 1024}, {"size-2048", 2048}, {"size-4096", 4096},
+  }};
+
+  SlabCache *SizeCache(size_t bytes) {
+    for (auto &cache : size_caches) {
+      if (bytes <= cache.ObjectBytes()) {
+        return &cache;
+      }
+    }
+    return nullptr;
+  }
+} // namespace
+
+void *SlabCache::Allocate() {
+  Slab *slab = partial_;
+  if (slab == nullptr) {
+    slab = empty_ ? empty_ : Grow();
+    if (slab == nullptr) {
+      return nullptr;
+    }
+    if (slab == empty_) {
+      empty_ = nullptr;
+    }
+    Push(partial_, slab);
+  }
+
+  void *obj = slab->free_objs;
+  slab->free_objs = *reinterpret_cast<void**>(obj);
+  ++slab->active;
+  if (slab->free_objs == nullptr) {
+    Remove(partial_, slab);
+    Push(full_, slab);
+  }
+
+  ++active_objects_;
+  ++allocs_;
+  return obj;
+}
+
+void SlabCache::Free(void *obj) {
+  Slab *slab = SlabOf(obj);
+  if (slab->free_objs == nullptr) {
+    Remove(full_, slab);
+    Push(partial_, slab);
+  }
+  *reinterpret_cast<void**>(obj) = slab->free_objs;
+  slab->free_objs = obj;
+  --slab->active;
+
+  --active_objects_;
+  ++frees_;
+
+  if (slab->active > 0) {
+    return;
+  }
+  Remove(partial_, slab);
+  if (empty_ == nullptr) {
+    empty_ = slab;
+    return;
+  }
+  --num_slabs_;
+  const auto frame = reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame;
+  memory_manager->Free(FrameID{frame}, size_t{1} << order_);
+}
+
+SlabStat SlabCache::Stat() const {
+  return {
+    object_bytes_,
+    active_objects_,
+    num_slabs_ * objects_per_slab_,
+    num_slabs_,
+    allocs_,
+    frees_,
+  };
+}
+
+SlabCache::Slab *SlabCache::Grow() {
+  if (objects_per_slab_ == 0) {
+    return nullptr;
+  }
+  auto [ frame, err ] = memory_manager->Allocate(size_t{1} << order_);
+  if (err) {
+    return nullptr;
+  }
+
+  if (!registered_) {
+    registered_ = true;
+    next_ = slab_caches;
+    slab_caches = this;
+  }
+  ++num_slabs_;
+
+  auto slab = reinterpret_cast<Slab*>(frame.Frame());
+  slab->next = slab->prev = nullptr;
+  slab->cache = this;
+  slab->active = 0;
+
+  // Chain the objects so that they are handed out in address order.
+  auto base = reinterpret_cast<uint8_t*>(slab) + header_bytes_;
+  slab->free_objs = base;
+  for (size_t i = 0; i < objects_per_slab_; ++i) {
+    void *next = i + 1 < objects_per_slab_ ? base + object_bytes_ : nullptr;
+    *reinterpret_cast<void**>(base) = next;
+    base += object_bytes_;
+  }
+  return slab;
+}
+
+SlabCache::Slab *SlabCache::SlabOf(void *obj) const {
+  const auto slab_bytes = kBytesPerFrame << order_;
+  return reinterpret_cast<Slab*>(
+      reinterpret_cast<uintptr_t>(obj) & ~(slab_bytes - 1));
+}
+
+void SlabCache::Push(Slab *&list, Slab *slab) {
+  slab->prev = nullptr;
+  slab->next = list;
+  if (list) {
+    list->prev = slab;
+  }
+  list = slab;
+}
+
+void SlabCache::Remove(Slab *&list, Slab *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    list = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = slab->prev = nullptr;
+}
+
+SlabCache *FirstSlabCache() {
+  return slab_caches;
+}
+
+void *SlabAllocate(size_t bytes) {
+  if (auto cache = SizeCache(bytes)) {
+    return cache->Allocate();
+  }
+  return ::operator new(bytes);
+}
+
+size_t SlabAllocatedBytes(size_t bytes) {
+  if (auto cache = SizeCache(bytes)) {
+    return cache->ObjectBytes();
+  }
+  return bytes;
+}
+
+void HandleSlabFailure(size_t bytes) {
+  if (auto handler = std::get_new_handler()) {
+    handler();
+    return;
+  }
+  Log(kError, "slab: failed to allocate %lu bytes\n", bytes);
+  exit(1);
+}
+
+void SlabFree(void *p, size_t bytes) {
+  if (auto cache = SizeCache(bytes)) {
+    cache->Free(p);
+  } else {
+    ::operator delete(p);
+  }
+}
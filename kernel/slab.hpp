@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "memory_manager.hpp"
+
+struct SlabStat {
+  size_t object_bytes;   // size of a single object including padding
+  size_t active_objects; // objects currently handed out
+  size_t total_objects;  // capacity of all slabs owned by the cache
+  size_t slabs;          // number of slabs owned by the cache
+  size_t allocs, frees;  // number of Allocate and Free calls so far
+};
+
+/** @brief A cache of fixed-size objects carved out of physical frames.
+ *
+ * A slab is a buddy block of 2^order frames taken from memory_manager.
+ * Its header (Slab) sits at the beginning of the block and the objects
+ * follow it. Since buddy blocks are aligned to their size, the slab
+ * an object belongs to is found by masking the object address.
+ *
+ * Freed objects are pushed onto the free list of their slab and handed
+ * out again by the next Allocate without going back to the frame
+ * allocator. The cache doesn't run constructors or destructors;
+ * callers construct objects in the returned storage.
+ *
+ * One empty slab is kept for reuse, further empty slabs are returned to
+ * memory_manager.
+ */
+class SlabCache {
+  public:
+    /** @brief The smallest alignment of the objects (bytes) */
+    static const size_t kMinAlign{16};
+
+    constexpr SlabCache(const char *name, size_t object_bytes,
+                        size_t align = kMinAlign)
+        : name_{name},
+          object_bytes_{RoundUp(object_bytes, align < kMinAlign ? kMinAlign : align)},
+          header_bytes_{RoundUp(sizeof(Slab), align < kMinAlign ? kMinAlign : align)},
+          order_{SlabOrder(header_bytes_, object_bytes_)},
+          objects_per_slab_{((kBytesPerFrame << order_) - header_bytes_) / object_bytes_} {
+    }
+
+    SlabCache(const SlabCache &) = delete;
+    SlabCache &operator=(const SlabCache &) = delete;
+
+    /** @brief Returns storage for one object, or nullptr if there is
+     * no memory left.
+     */
+    void *Allocate();
+
+    /** @brief Returns storage obtained by Allocate of this cache. */
+    void Free(void *obj);
+
+    const char *Name() const { return name_; }
+    size_t ObjectBytes() const { return object_bytes_; }
+    SlabStat Stat() const;
+
+    /** @brief Returns the next cache that has allocated a slab at least once.
+     * The list starts with FirstSlabCache().
+     */
+    SlabCache *Next() const { return next_; }
+
+  private:
+    struct Slab {
+      Slab *next;
+      Slab *prev;
+      SlabCache *cache;
+      void *free_objs; // singly linked through the first word of each object
+      size_t active;   // objects handed out from this slab
+    };
+
+    /** @brief The number of objects a slab should hold at least */
+    static const size_t kMinObjectsPerSlab{8};
+
+    const char *name_;
+    size_t object_bytes_;
+    size_t header_bytes_;
+    int order_;
+    size_t objects_per_slab_;
+
+    Slab *partial_{nullptr}; // slabs having both free and used objects
+    Slab *full_{nullptr};    // slabs having no free objects
+    Slab *empty_{nullptr};   // at most one slab having no used objects
+    size_t num_slabs_{0};
+    size_t active_objects_{0};
+    size_t allocs_{0}, frees_{0};
+    bool registered_{false};
+    SlabCache *next_{nullptr};
+
+    static constexpr size_t RoundUp(size_t value, size_t align) {
+      return (value + align - 1) / align * align;
+    }
+
+    static constexpr int SlabOrder(size_t header_bytes, size_t object_bytes) {
+      int order = 0;
+      while (order < BitmapMemoryManager::kMaxOrder &&
+             (kBytesPerFrame << order) <
+             header_bytes + kMinObjectsPerSlab * object_bytes) {
+        ++order;
+      }
+      return order;
+    }
+
+    Slab *Grow();
+    Slab *SlabOf(void *obj) const;
+    static void Push(Slab *&list, Slab *slab);
+    static void Remove(Slab *&list, Slab *slab);
+};
+
+/** @brief Returns the first of the caches that have allocated a slab. */
+SlabCache *FirstSlabCache();
+
+/** @brief Returns the cache dedicated to objects of type T. */
+template <class T>
+SlabCache &TypeCache() {
+  static SlabCache cache{__PRETTY_FUNCTION__, sizeof(T), alignof(T)};
+  return cache;
+}
+
+/** @brief Allocates bytes from a size-class cache.
+ * Requests larger than the largest size class go to operator new.
+ */
+void *SlabAllocate(size_t bytes);
+
+/** @brief Returns the bytes SlabAllocate(bytes) actually takes up,
+ * the size of its size class.
+ */
+size_t SlabAllocatedBytes(size_t bytes);
+
+/** @brief Handles a failed slab allocation of bytes the way operator new
+ * does: calls the new handler, which may free memory, so that the caller
+ * can retry. Without a handler it reports the failure and stops, since
+ * memory from other allocators can't be returned to a slab cache.
+ */
+void HandleSlabFailure(size_t bytes);
+
+/** @brief Frees memory allocated by SlabAllocate(bytes). */
+void SlabFree(void *p, size_t bytes);
+
+/** @brief A C++ allocator backed by the slab caches.
+ *
+ * Single objects come from TypeCache<T>(), arrays (vector buffers,
+ * deque blocks and the like) from the size-class caches.
+ */
+template <class T>
+class SlabAllocator {
+  public:
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <class U>
+    SlabAllocator(const SlabAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+      void *p;
+      while ((p = n == 1 ? TypeCache<T>().Allocate() : SlabAllocate(n * sizeof(T)))
+             == nullptr) {
+        HandleSlabFailure(n * sizeof(T));
+      }
+      return static_cast<T*>(p);
+    }
+
+    void deallocate(T *p, size_t n) {
+      if (n == 1) {
+        TypeCache<T>().Free(p);
+      } else {
+        SlabFree(p, n * sizeof(T));
+      }
+    }
+};
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T> &, const SlabAllocator<U> &) {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const SlabAllocator<T> &, const SlabAllocator<U> &) {
+  return false;
+}
+
+/** @brief Routes new and delete of a class to its slab cache.
+ *
+ * A class T deriving from SlabObject<T> is allocated from TypeCache<T>().
+ * Objects of classes derived from T have a different size and
+ * go to the size-class caches instead.
+ */
+template <class T>
+class SlabObject {
+  public:
+    static void *operator new(size_t size) {
+      void *p;
+      while ((p = size == sizeof(T) ? TypeCache<T>().Allocate() : SlabAllocate(size))
+             == nullptr) {
+        HandleSlabFailure(size);
+      }
+      return p;
+    }
+
+    static void operator delete(void *p, size_t size) {
+      if (size == sizeof(T)) {
+        TypeCache<T>().Free(p);
+      } else {
+        SlabFree(p, size);
+      }
+    }
+};
+
+/** @brief std::make_shared allocating the object and its control block
+ * from TypeCache.
+ */
+template <class T, class... Args>
+std::shared_ptr<T> MakeSlabShared(Args&&... args) {
+  return std::allocate_shared<T>(SlabAllocator<T>{}, std::forward<Args>(args)...);
+}
@@ -0,0 +1,224 @@
+#include "smp.hpp"
+
+#include <array>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+/** @brief The processor holding the kernel lock, -1 if none.
+ * The bootstrap processor holds it from boot.
+ */
+extern "C" int kernel_lock_owner;
+int kernel_lock_owner = 0;
+
+namespace {
+  const int kNoOwner = -1;
+  const size_t kAPStackFrames = 8;
+  const uint64_t kCR4PGE = 1 << 7;
+  const uint64_t kCR4PCIDE = 1 << 17;
+
+  volatile uint32_t &lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+  volatile uint32_t &spurious_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+  volatile uint32_t &icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+  volatile uint32_t &icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+  /** @brief Parameters of the startup code, ap_boot_data in asmfunc.asm */
+  struct APBootData {
+    uint32_t cr0, cr3, cr4, cpu;
+    uint64_t stack, entry;
+  } __attribute__((packed));
+
+  std::array<uint8_t, kMaxCPUs> apic_ids{};
+  std::array<uint8_t, 256> cpu_of_apic_id{}; // the bootstrap processor is 0
+  int num_cpus = 1;
+
+  /** @brief Handshake between StartAP and ApMain: the application
+   * processor reports kAPStarted, and the bootstrap processor answers
+   * kAPAccepted once the processor is counted in num_cpus.
+   */
+  enum APState { kAPWaiting, kAPStarted, kAPAccepted };
+  int ap_state = kAPWaiting;
+  uint64_t bsp_cr4;
+
+  uint64_t kernel_tlb_generation = 0;
+  std::array<uint64_t, kMaxCPUs> seen_tlb_generation{};
+  SMPStat stat{};
+
+  void FlushGlobalTLB() {
+    const auto cr4 = GetCR4();
+    SetCR4(cr4 & ~kCR4PGE);
+    SetCR4(cr4);
+  }
+
+  void SendIPI(uint8_t apic_id, uint32_t command) {
+    icr_high = static_cast<uint32_t>(apic_id) << 24;
+    icr_low = command;
+    while (icr_low & (1u << 12)); // delivery status: send pending
+  }
+
+  /** @brief The entry point of an application processor in 64-bit mode,
+   * running on the stack StartAP allocated.
+   */
+  [[noreturn]] void ApMain(int cpu) {
+    // CurrentCPU doesn't know this processor until num_cpus counts it.
+    __atomic_store_n(&ap_state, kAPStarted, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&ap_state, __ATOMIC_ACQUIRE) != kAPAccepted) {
+      __builtin_ia32_pause();
+    }
+
+    LoadSegmentsOnAP(cpu);
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    SetCR4(bsp_cr4);
+    spurious_vector = 0x1ff; // enable the local APIC
+
+    AcquireKernelLock();
+    InitializeSyscall();
+    StartLAPICTimerOnCPU();
+    Log(kInfo, "CPU %d (APIC ID %u) started\n", cpu, apic_ids[cpu]);
+    task_manager->StartCPU(cpu);
+  }
+
+  /** @brief Sends INIT and startup IPIs to a processor and waits for it
+   * to reach ApMain. A processor that doesn't is sent INIT again, so that
+   * it can't start late on the boot data of the next one.
+   */
+  bool StartAP(int cpu, uint8_t apic_id, APBootData &boot_data) {
+    auto [ stack, err ] = memory_manager->Allocate(kAPStackFrames);
+    if (err) {
+      Log(kError, "failed to allocate the stack of CPU %d: %s\n", cpu, err.Name());
+      return false;
+    }
+    SetupTSS(cpu);
+
+    boot_data.cpu = cpu;
+    boot_data.stack =
+      reinterpret_cast<uint64_t>(stack.Frame()) + kAPStackFrames * kBytesPerFrame;
+    apic_ids[cpu] = apic_id;
+    cpu_of_apic_id[apic_id] = cpu;
+    __atomic_store_n(&ap_state, kAPWaiting, __ATOMIC_RELEASE);
+
+    SendIPI(apic_id, 0x0000'4500); // INIT, level assert
+    acpi::WaitMilliseconds(10);
+    for (int i = 0; i < 2; ++i) {
+      SendIPI(apic_id, 0x0000'4600 | (kAPTrampolineAddr >> 12)); // startup
+      for (int ms = 0; ms < 100; ++ms) {
+        if (__atomic_load_n(&ap_state, __ATOMIC_ACQUIRE) == kAPStarted) {
+          ++num_cpus;
+          __atomic_store_n(&ap_state, kAPAccepted, __ATOMIC_RELEASE);
+          return true;
+        }
+        acpi::WaitMilliseconds(1);
+      }
+    }
+
+    SendIPI(apic_id, 0x0000'4500);
+    cpu_of_apic_id[apic_id] = 0;
+    memory_manager->Free(stack, kAPStackFrames);
+    Log(kError, "CPU %d (APIC ID %u) didn't start\n", cpu, apic_id);
+    return false;
+  }
+} // namespace
+
+int CurrentCPU() {
+  if (num_cpus == 1) {
+    return 0;
+  }
+  return cpu_of_apic_id[lapic_id >> 24];
+}
+
+int NumCPUs() {
+  return num_cpus;
+}
+
+uint8_t APICIDOf(int cpu) {
+  return apic_ids[cpu];
+}
+
+void SendInterrupt(int cpu, uint8_t vector) {
+  SendIPI(apic_ids[cpu], vector); // fixed delivery mode, physical destination
+}
+
+extern "C" bool AcquireKernelLock() {
+  const int cpu = CurrentCPU();
+  if (__atomic_load_n(&kernel_lock_owner, __ATOMIC_RELAXED) == cpu) {
+    return false;
+  }
+
+  size_t spins = 0;
+  int expected = kNoOwner;
+  while (!__atomic_compare_exchange_n(&kernel_lock_owner, &expected, cpu, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    // Spin on a plain load so that waiting doesn't steal the cache line
+    // from the holder.
+    while (__atomic_load_n(&kernel_lock_owner, __ATOMIC_RELAXED) != kNoOwner) {
+      __builtin_ia32_pause();
+      ++spins;
+    }
+    expected = kNoOwner;
+  }
+
+  ++stat.lock_acquires;
+  stat.lock_spins += spins;
+  if (seen_tlb_generation[cpu] != kernel_tlb_generation) {
+    seen_tlb_generation[cpu] = kernel_tlb_generation;
+    FlushGlobalTLB();
+  }
+  return true;
+}
+
+extern "C" void ReleaseKernelLock() {
+  __atomic_store_n(&kernel_lock_owner, kNoOwner, __ATOMIC_RELEASE);
+}
+
+void NotifyKernelUnmap() {
+  ++kernel_tlb_generation;
+  seen_tlb_generation[CurrentCPU()] = kernel_tlb_generation;
+  if (num_cpus > 1) {
+    ++stat.kernel_unmaps;
+  }
+}
+
+SMPStat GetSMPStat() {
+  return stat;
+}
+
+void StartApplicationProcessors() {
+  if (acpi::madt == nullptr) {
+    Log(kWarn, "MADT is not found, running on a single processor\n");
+    return;
+  }
+
+  const uint8_t bsp_id = lapic_id >> 24;
+  apic_ids[0] = bsp_id;
+  bsp_cr4 = GetCR4();
+
+  memcpy(reinterpret_cast<void*>(kAPTrampolineAddr), APTrampoline,
+         APTrampolineEnd - APTrampoline);
+  auto &boot_data = *reinterpret_cast<APBootData*>(
+      kAPTrampolineAddr + (ap_boot_data - APTrampoline));
+  boot_data.cr0 = GetCR0();
+  boot_data.cr3 = GetCR3() & 0xffff'f000; // the kernel page map is below 4 GiB
+  boot_data.cr4 = bsp_cr4 & ~kCR4PCIDE;   // PCIDE can be set only in 64-bit mode
+  boot_data.entry = reinterpret_cast<uint64_t>(ApMain);
+
+  acpi::madt->ForEachLocalAPIC([&](uint8_t apic_id) {
+    if (apic_id == bsp_id) {
+      return;
+    }
+    if (num_cpus == kMaxCPUs) {
+      Log(kWarn, "too many processors, APIC ID %u is not used\n", apic_id);
+      return;
+    }
+    // A processor failing to start keeps its index for the next one.
+    StartAP(num_cpus, apic_id, boot_data);
+  });
+  Log(kWarn, "%d processors are running\n", num_cpus);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/** @brief The maximum number of processors the kernel runs on */
+const int kMaxCPUs = 16;
+
+/** @brief The physical address the startup code of application processors
+ * is copied to. A startup IPI starts them at this 4 KiB aligned address
+ * below 1 MiB in real mode.
+ */
+const uintptr_t kAPTrampolineAddr = 0x8000;
+
+/** @brief Returns the index of the running processor.
+ * 0 is the bootstrap processor, application processors follow in the order
+ * they were started.
+ */
+int CurrentCPU();
+
+/** @brief Returns the number of processors running the kernel. */
+int NumCPUs();
+
+/** @brief Returns the local APIC ID of a processor. */
+uint8_t APICIDOf(int cpu);
+
+/** @brief Sends an interrupt of the vector to another processor. */
+void SendInterrupt(int cpu, uint8_t vector);
+
+/** @brief Takes the kernel lock for the running processor.
+ *
+ * The kernel lock serializes all kernel code across processors: it is held
+ * from the entry into the kernel (interrupt, exception or system call) to
+ * the return to the application, and while a processor runs kernel tasks.
+ * The idle task releases it while halting.
+ *
+ * This is a deliberate first step rather than per-structure spinlocks:
+ * the memory manager, task manager, file system and the other globals
+ * were written for a single processor, and one lock makes all of them
+ * safe at once. Applications run in parallel, kernel code doesn't.
+ * Narrowing it means giving each of those structures its own lock and
+ * then dropping this one from the entry paths.
+ *
+ * Must be called with interrupts disabled.
+ * @return true if the lock was taken, false if the processor already held it
+ */
+extern "C" bool AcquireKernelLock();
+
+/** @brief Releases the kernel lock. */
+extern "C" void ReleaseKernelLock();
+
+/** @brief Holds the kernel lock during an interrupt handler unless the
+ * interrupted code already held it.
+ */
+class KernelLockGuard {
+  public:
+    KernelLockGuard() : acquired_{AcquireKernelLock()} {}
+    ~KernelLockGuard() {
+      if (acquired_) {
+        ReleaseKernelLock();
+      }
+    }
+    KernelLockGuard(const KernelLockGuard &) = delete;
+    KernelLockGuard &operator=(const KernelLockGuard &) = delete;
+
+  private:
+    bool acquired_;
+};
+
+/** @brief Tells other processors that a global kernel mapping was removed.
+ * They flush their global TLB entries when they next take the kernel lock.
+ * Called with the kernel lock held.
+ */
+void NotifyKernelUnmap();
+
+struct SMPStat {
+  size_t lock_acquires;  // times the kernel lock was taken
+  size_t lock_spins;     // busy loop iterations waiting for the lock
+  size_t kernel_unmaps;  // NotifyKernelUnmap calls with other processors running
+};
+
+SMPStat GetSMPStat();
+
+/** @brief Starts the application processors listed in the MADT.
+ *
+ * Each processor gets its own TSS, stacks and local APIC timer, then runs
+ * its idle task and takes tasks from TaskManager. Call after the task
+ * manager and the local APIC timer are initialized.
+ */
+void StartApplicationProcessors();
@@ -0,0 +1,277 @@
+#include "swap.hpp"
+
+#include <cstring>
+#include <vector>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "lz.hpp"
+#include "memory_manager.hpp"
+#include "slab.hpp"
+#include "zero_pool.hpp"
+
+size_t swap_low_free_frames = 1024;
+
+namespace {
+  /** @brief Marks a non-present entry as a swap entry. It is one of the
+   * bits available to software, and the slot index lies in the address.
+   */
+  const uint64_t kSwapEntryBit = 1 << 9;
+
+  /** @brief Marks a present entry whose page didn't compress, together
+   * with a clear dirty bit. Until the page is written again, scans skip
+   * it instead of compressing it once more.
+   */
+  const uint64_t kIncompressibleBit = 1 << 10;
+
+  /** @brief Pages compressing to more than this stay resident.
+   * SlabAllocate rounds up to a power of two, so anything larger would
+   * take a whole 4 KiB object and save nothing.
+   */
+  const size_t kMaxStoredBytes = 2048;
+
+  struct Slot {
+    uint8_t *data; // nullptr for a zero-filled page
+    size_t bytes;  // 0 for a free slot or a zero-filled page
+  };
+
+  std::vector<Slot> slots;
+  std::vector<size_t> free_slots;
+  SwapStat stat{};
+
+  // Only used with interrupts disabled in the page fault handler.
+  uint8_t compress_buf[kMaxStoredBytes];
+  uint16_t compress_table[kLZHashEntries];
+
+  struct SwapScan {
+    uint64_t begin, end;   // scanned address range
+    size_t max_pages;
+    size_t swapped;
+    bool examined;         // some candidate page was examined
+    uint64_t last_addr;    // address of the last candidate page examined
+    bool cleared_accessed; // accessed bits were cleared
+  };
+
+  PageMapEntry *cursor_pml4 = nullptr;
+  uint64_t cursor_addr = 0;
+
+  FrameID FrameOf(const PageMapEntry &entry) {
+    return FrameID{entry.bits.addr};
+  }
+
+  bool IsZeroPage(const uint8_t *page) {
+    auto p = reinterpret_cast<const uint64_t*>(page);
+    for (size_t i = 0; i < kBytesPerFrame / sizeof(*p); ++i) {
+      if (p[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t AllocateSlot() {
+    if (free_slots.empty()) {
+      slots.push_back({nullptr, 0});
+      return slots.size() - 1;
+    }
+    const size_t i = free_slots.back();
+    free_slots.pop_back();
+    return i;
+  }
+
+  void FreeSlot(size_t i) {
+    auto &slot = slots[i];
+    if (slot.data) {
+      SlabFree(slot.data, slot.bytes);
+      stat.compressed_bytes -= slot.bytes;
+      stat.stored_bytes -= SlabAllocatedBytes(slot.bytes);
+    }
+    slot = {nullptr, 0};
+    --stat.stored_pages;
+    free_slots.push_back(i);
+  }
+
+  size_t SlotOf(const PageMapEntry &entry) {
+    return entry.data >> 12;
+  }
+
+  /** @brief Compresses the page entry maps and replaces the entry with
+   * a swap entry.
+   * @return false if the page doesn't compress well enough, in which case
+   *   the entry is marked with kIncompressibleBit
+   */
+  bool SwapOutPage(PageMapEntry &entry, uint64_t addr) {
+    const auto frame = FrameOf(entry);
+    const auto page = reinterpret_cast<const uint8_t*>(frame.Frame());
+
+    Slot slot{nullptr, 0};
+    if (!IsZeroPage(page)) {
+      const size_t bytes =
+        LZCompress(page, kBytesPerFrame, compress_buf, sizeof(compress_buf),
+                   compress_table);
+      if (bytes == 0) {
+        ++stat.rejected;
+        entry.data |= kIncompressibleBit;
+        entry.bits.dirty = 0;
+        InvalidateTLB(addr); // so that the next write sets the dirty bit
+        return false;
+      }
+      slot.data = static_cast<uint8_t*>(SlabAllocate(bytes));
+      if (slot.data == nullptr) {
+        return false;
+      }
+      memcpy(slot.data, compress_buf, bytes);
+      slot.bytes = bytes;
+    }
+
+    const size_t i = AllocateSlot();
+    slots[i] = slot;
+    entry.data = i << 12 | kSwapEntryBit;
+    InvalidateTLB(addr);
+    memory_manager->DecrementRefCount(frame);
+    memory_manager->Free(frame, 1);
+
+    ++stat.stored_pages;
+    stat.compressed_bytes += slot.bytes;
+    if (slot.data) {
+      stat.stored_bytes += SlabAllocatedBytes(slot.bytes);
+    }
+    ++stat.swap_outs;
+    return true;
+  }
+
+  void ScanPageMap(PageMapEntry *page_map, int page_map_level,
+                   uint64_t base, SwapScan &scan) {
+    const uint64_t entry_bytes = uint64_t{1} << (12 + 9 * (page_map_level - 1));
+    for (int i = 0; i < 512 && scan.swapped < scan.max_pages; ++i) {
+      auto &entry = page_map[i];
+      const uint64_t addr = base + i * entry_bytes;
+      if (!entry.bits.present ||
+          addr + (entry_bytes - 1) < scan.begin || scan.end <= addr) {
+        continue;
+      }
+
+      if (page_map_level > 1) {
+        // Skip 2 MiB pages and tables shared with other address spaces.
+        if (entry.bits.huge_page ||
+            memory_manager->RefCount(FrameOf(entry)) > 0) {
+          continue;
+        }
+        ScanPageMap(entry.Pointer(), page_map_level - 1, addr, scan);
+        continue;
+      }
+
+      if (!entry.bits.user || !entry.bits.writable ||
+          memory_manager->RefCount(FrameOf(entry)) != 1) {
+        continue;
+      }
+      scan.examined = true;
+      scan.last_addr = addr;
+      if (entry.bits.accessed) {
+        entry.bits.accessed = 0;
+        scan.cleared_accessed = true;
+      } else if ((entry.data & kIncompressibleBit) && !entry.bits.dirty) {
+        continue; // unchanged since it failed to compress
+      } else if (SwapOutPage(entry, addr)) {
+        ++scan.swapped;
+      }
+    }
+  }
+
+  void ScanUserHalf(PageMapEntry *pml4_table, SwapScan &scan) {
+    const uint64_t entry_bytes = uint64_t{1} << 39;
+    for (int i = 256; i < 512 && scan.swapped < scan.max_pages; ++i) {
+      auto &entry = pml4_table[i];
+      const uint64_t addr = 0xffff'0000'0000'0000 + i * entry_bytes;
+      if (!entry.bits.present ||
+          addr + (entry_bytes - 1) < scan.begin || scan.end <= addr ||
+          memory_manager->RefCount(FrameOf(entry)) > 0) {
+        continue;
+      }
+      ScanPageMap(entry.Pointer(), 3, addr, scan);
+    }
+  }
+} // namespace
+
+bool IsSwapEntry(const PageMapEntry &entry) {
+  return !entry.bits.present && (entry.data & kSwapEntryBit);
+}
+
+Error SwapInPage(PageMapEntry &entry) {
+  const uint64_t begin_tsc = __builtin_ia32_rdtsc();
+  const size_t i = SlotOf(entry);
+  const Slot slot = slots[i];
+
+  auto [ frame, err ] =
+    slot.data ? memory_manager->Allocate(1) : AllocateZeroedFrame();
+  if (err) {
+    return err;
+  }
+  if (slot.data) {
+    const auto page = reinterpret_cast<uint8_t*>(frame.Frame());
+    if (LZDecompress(slot.data, slot.bytes, page, kBytesPerFrame)
+        != kBytesPerFrame) {
+      memory_manager->Free(frame, 1);
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+  }
+  FreeSlot(i);
+
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  entry.bits.user = 1;
+  memory_manager->IncrementRefCount(frame);
+
+  ++stat.swap_ins;
+  stat.swap_in_cycles += __builtin_ia32_rdtsc() - begin_tsc;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void DropSwapEntry(PageMapEntry &entry) {
+  // Unmapping syscalls get here with interrupts enabled.
+  const bool intr = SaveAndDisableInterrupts();
+  FreeSlot(SlotOf(entry));
+  entry.data = 0;
+  RestoreInterrupts(intr);
+}
+
+size_t SwapOutColdPages(PageMapEntry *pml4_table, size_t max_pages) {
+  if (pml4_table != cursor_pml4) {
+    cursor_pml4 = pml4_table;
+    cursor_addr = 0;
+  }
+
+  // Resume from the cursor and wrap around. The first round may only
+  // clear accessed bits, so the space is scanned twice at most.
+  SwapScan scan{0, 0, max_pages, 0, false, 0, false};
+  for (int round = 0; round < 2 && scan.swapped < max_pages; ++round) {
+    scan.cleared_accessed = false;
+    scan.begin = cursor_addr;
+    scan.end = ~uint64_t{0};
+    ScanUserHalf(pml4_table, scan);
+    scan.begin = 0;
+    scan.end = cursor_addr;
+    ScanUserHalf(pml4_table, scan);
+
+    if (scan.cleared_accessed) {
+      // Drop TLB entries caching the accessed bits just cleared, so that
+      // the processor sets them again on the next access.
+      SetCR3(GetCR3());
+    }
+  }
+  // Move on past the pages examined even if none was swapped out, so
+  // that the next scan starts from other pages.
+  if (scan.examined) {
+    cursor_addr = scan.last_addr + kBytesPerFrame;
+  }
+  return scan.swapped;
+}
+
+SwapStat GetSwapStat() {
+  __asm__("cli");
+  auto s = stat;
+  __asm__("sti");
+  return s;
+}
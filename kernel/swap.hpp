@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "paging.hpp"
+
+struct SwapStat {
+  size_t stored_pages;    // pages held compressed
+  size_t compressed_bytes; // compressed bytes of them
+  size_t stored_bytes;    // slab memory holding them
+  size_t swap_outs;       // pages compressed so far
+  size_t swap_ins;        // pages decompressed on faults
+  size_t rejected;        // pages left resident as incompressible
+  uint64_t swap_in_cycles; // TSC cycles spent in swap-ins
+};
+
+/** @brief Free frames below which page faults swap out cold pages */
+extern size_t swap_low_free_frames;
+
+/** @brief Returns true if entry is a page table entry of a page
+ * swapped out by SwapOutColdPages.
+ */
+bool IsSwapEntry(const PageMapEntry &entry);
+
+/** @brief Decompresses the page of a swap entry into a new frame and
+ * maps it writable in place of the swap entry.
+ */
+Error SwapInPage(PageMapEntry &entry);
+
+/** @brief Discards the page of a swap entry and clears the entry. */
+void DropSwapEntry(PageMapEntry &entry);
+
+/** @brief Compresses up to max_pages cold pages of the current address
+ * space into the swap pool and frees their frames.
+ *
+ * Candidates are 4 KiB user pages that are writable and private to the
+ * address space (demand paging, anonymous mappings, stacks and pages
+ * copied on write) in page tables not shared with other address spaces.
+ * The accessed bit serves as a clock: a scan clears it, and a page
+ * still unaccessed at the next scan is swapped out. Pages that don't
+ * compress to 2 KiB stay resident and are skipped until they are written.
+ *
+ * @return The number of pages swapped out
+ */
+size_t SwapOutColdPages(PageMapEntry *pml4_table, size_t max_pages);
+
+SwapStat GetSwapStat();
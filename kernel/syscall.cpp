@@ -1,10 +1,13 @@
 #include "syscall.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
+#include <limits>
 #include <utility>
 
 #include <fcntl.h>
@@ -17,6 +20,8 @@
 #include "layer.hpp"
 #include "logger.hpp"
 #include "msr.hpp"
+#include "paging.hpp"
+#include "slab.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "timer.hpp"
@@ -75,7 +80,7 @@ SYSCALL(Exit) {
 SYSCALL(OpenWindow) {
   const int w = arg1, h = arg2, x = arg3, y = arg4;
   const auto title = reinterpret_cast<const char*>(arg5);
-  const auto win = std::make_shared<ToplevelWindow>(
+  const auto win = MakeSlabShared<ToplevelWindow>(
     w, h, screen_config.pixel_format, title);
   
   __asm__("cli");
@@ -302,6 +307,66 @@ SYSCALL(CreateTimer) {
   return { timeout * 1000 / kTimerFreq, 0 };
 }
 
+/** @brief The shortest period of application timers, so that they don't
+ * keep the processor in interrupts.
+ */
+const uint64_t kMinTimerPeriodUs = 100;
+
+/** @brief CreateTimer with a deadline in microseconds instead of
+ * milliseconds rounded to the timer tick.
+ * The event reports the deadline in microseconds since boot. A periodic
+ * timer (mode bit 1) expires every timeout_us until it is cancelled.
+ * The handle for CancelTimer is stored to arg4 unless it is null.
+ */
+SYSCALL(CreateHRTimer) {
+  const unsigned int mode = arg1;
+  const int timer_value = arg2;
+  const bool periodic = mode & 2;
+  uint64_t *handle = reinterpret_cast<uint64_t*>(arg4);
+  if (timer_value <= 0) {
+    return { 0, EINVAL };
+  }
+  if (periodic && ((mode & 1) == 0 || arg3 < kMinTimerPeriodUs)) {
+    return { 0, EINVAL };
+  }
+
+  __asm__("cli");
+  const uint64_t task_id = task_manager->CurrentTask().ID();
+  __asm__("sti");
+
+  uint64_t deadline_us = arg3;
+  if (mode & 1) { // relative
+    deadline_us += CurrentNanoseconds() / 1000;
+  }
+  const uint64_t deadline_ns =
+    deadline_us < std::numeric_limits<uint64_t>::max() / 1000 ?
+    deadline_us * 1000 : std::numeric_limits<uint64_t>::max();
+
+  Timer timer{deadline_ns, deadline_us, -timer_value, task_id};
+  if (periodic) {
+    timer.SetPeriod(arg3 * 1000, arg3);
+  }
+
+  __asm__("cli");
+  const auto timer_handle = timer_manager->AddTimer(timer);
+  __asm__("sti");
+  if (handle) {
+    *handle = timer_handle;
+  }
+  return { deadline_us, 0 };
+}
+
+SYSCALL(CancelTimer) {
+  __asm__("cli");
+  const uint64_t task_id = task_manager->CurrentTask().ID();
+  const auto err = timer_manager->CancelAppTimer(arg1, task_id);
+  __asm__("sti");
+  if (err.Cause() == Error::kNotPermitted) {
+    return { 0, EPERM };
+  }
+  return { 0, err ? ENOENT : 0 };
+}
+
 namespace {
 
   size_t AllocateFD(Task &task) {
@@ -315,6 +380,62 @@ namespace {
     return num_files;
   }
 
+  /** @brief Reserves a range of bytes aligned to align for a file or
+   * anonymous mapping. The lowest unmapped range large enough is reused,
+   * if any.
+   */
+  uint64_t AllocateFileMapRange(Task &task, uint64_t bytes,
+                                uint64_t align = 4096) {
+    auto &free_ranges = task.FreeFileMapRanges();
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+      const auto [ begin, end ] = *it;
+      const uint64_t aligned = (begin + align - 1) & ~(align - 1);
+      if (aligned >= end || end - aligned < bytes) {
+        continue;
+      }
+      free_ranges.erase(it);
+      if (begin < aligned) {
+        free_ranges[begin] = aligned;
+      }
+      if (aligned + bytes < end) {
+        free_ranges[aligned + bytes] = end;
+      }
+      return aligned;
+    }
+
+    const uint64_t end = task.FileMapEnd();
+    const uint64_t begin = (end - bytes) & ~(align - 1);
+    if (begin + bytes < end) {
+      free_ranges[begin + bytes] = end;
+    }
+    task.SetFileMapEnd(begin);
+    return begin;
+  }
+
+  /** @brief Returns the range of an unmapped file mapping,
+   * merging it with adjacent unmapped ranges.
+   */
+  void FreeFileMapRange(Task &task, uint64_t begin, uint64_t end) {
+    auto &free_ranges = task.FreeFileMapRanges();
+    auto next = free_ranges.lower_bound(begin);
+    if (next != free_ranges.end() && next->first == end) {
+      end = next->second;
+      next = free_ranges.erase(next);
+    }
+    if (next != free_ranges.begin()) {
+      if (auto prev = std::prev(next); prev->second == begin) {
+        begin = prev->first;
+        free_ranges.erase(prev);
+      }
+    }
+
+    if (begin == task.FileMapEnd()) {
+      task.SetFileMapEnd(end);
+    } else {
+      free_ranges[begin] = end;
+    }
+  }
+
   std::pair<fat::DirectoryEntry*, int> CreateFile(const char *path) {
     auto [ file, err ] = fat::CreateFile(path);
     switch (err.Cause()) {
@@ -353,7 +474,7 @@ SYSCALL(OpenFile) {
   }
 
   size_t fd = AllocateFD(task);
-  task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+  task.Files()[fd] = MakeSlabShared<fat::FileDescriptor>(*file);
   return { fd, 0 };
 }
 
@@ -396,20 +517,115 @@ SYSCALL(MapFile) {
   }
 
   *file_size = task.Files()[fd]->Size();
-  const uint64_t vaddr_end = task.FileMapEnd();
-  const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xffff'ffff'ffff'f000;
-  task.SetFileMapEnd(vaddr_begin);
-  task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+  const uint64_t map_bytes =
+    std::max<uint64_t>((*file_size + 4095) & 0xffff'ffff'ffff'f000, 4096);
+  const uint64_t vaddr_begin = AllocateFileMapRange(task, map_bytes);
+  const uint64_t vaddr_end = vaddr_begin + map_bytes;
+  task.FileMaps()[vaddr_end] = FileMapping{fd, vaddr_begin, vaddr_end};
   return { vaddr_begin, 0 };
 }
 
+SYSCALL(UnmapFile) {
+  const uint64_t vaddr = arg1;
+  __asm__("cli");
+  auto &task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  auto &fmaps = task.FileMaps();
+  auto it = fmaps.upper_bound(vaddr);
+  if (it == fmaps.end() || it->second.vaddr_begin != vaddr) {
+    return { 0, EINVAL };
+  }
+  const FileMapping m = it->second;
+
+  // Keep the mapping on failure: its pages may be partly mapped still.
+  if (auto err = UnmapPages(LinearAddress4Level{m.vaddr_begin},
+                            (m.vaddr_end - m.vaddr_begin) / 4096)) {
+    return { 0, EFAULT };
+  }
+  fmaps.erase(it);
+  FreeFileMapRange(task, m.vaddr_begin, m.vaddr_end);
+  return { 0, 0 };
+}
+
+namespace {
+  // Flags of SyscallMapMemory, see apps/syscall.h
+  const int kMemPopulate = 1;  // maps all pages at once
+  const int kMemHuge = 2;      // prefers 2 MiB pages
+  const int kMemNoReserve = 4; // skips the free memory check
+
+  const uint64_t kHugePageBytes = 512 * 4096;
+} // namespace
+
+SYSCALL(MapMemory) {
+  const size_t bytes = arg1;
+  const int flags = arg2;
+  __asm__("cli");
+  auto &task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  const bool huge = flags & kMemHuge;
+  const uint64_t align = huge ? kHugePageBytes : 4096;
+  if (bytes == 0 || bytes > task.FileMapEnd() - task.DPagingEnd() - align) {
+    return { 0, bytes == 0 ? EINVAL : ENOMEM };
+  }
+  const uint64_t map_bytes = (bytes + align - 1) & ~(align - 1);
+  const size_t num_pages = map_bytes / 4096;
+
+  // Pages are allocated on page faults, so this is a check rather than
+  // a reservation; it rejects requests that can never be satisfied.
+  if ((flags & kMemNoReserve) == 0) {
+    const auto stat = memory_manager->Stat();
+    if (stat.total_frames - stat.allocated_frames < num_pages) {
+      return { 0, ENOMEM };
+    }
+  }
+
+  const uint64_t vaddr_begin = AllocateFileMapRange(task, map_bytes, align);
+  const uint64_t vaddr_end = vaddr_begin + map_bytes;
+  task.AnonMaps()[vaddr_end] = AnonMapping{vaddr_begin, vaddr_end, huge};
+
+  if (flags & kMemPopulate) {
+    if (auto err = SetupPageMaps(LinearAddress4Level{vaddr_begin}, num_pages)) {
+      UnmapPages(LinearAddress4Level{vaddr_begin}, num_pages);
+      task.AnonMaps().erase(vaddr_end);
+      FreeFileMapRange(task, vaddr_begin, vaddr_end);
+      return { 0, ENOMEM };
+    }
+  }
+  return { vaddr_begin, 0 };
+}
+
+SYSCALL(UnmapMemory) {
+  const uint64_t vaddr = arg1;
+  __asm__("cli");
+  auto &task = task_manager->CurrentTask();
+  __asm__("sti");
+
+  auto &amaps = task.AnonMaps();
+  auto it = amaps.upper_bound(vaddr);
+  if (it == amaps.end() || it->second.vaddr_begin != vaddr) {
+    return { 0, EINVAL };
+  }
+  const AnonMapping m = it->second;
+
+  // Keep the mapping on failure: its pages may be partly mapped still.
+  if (auto err = UnmapPages(LinearAddress4Level{m.vaddr_begin},
+                            (m.vaddr_end - m.vaddr_begin) / 4096)) {
+    return { 0, EFAULT };
+  }
+  amaps.erase(it);
+  FreeFileMapRange(task, m.vaddr_begin, m.vaddr_end);
+  return { 0, 0 };
+}
+
 #undef SYSCALL
 
 } // namespace syscall
 
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t,
                                  uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x15> syscall_table{
   /* 0x00 */ syscall::LogString,
   /* 0x01 */ syscall::PutString,
   /* 0x02 */ syscall::Exit,
@@ -426,6 +642,11 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
   /* 0x0d */ syscall::ReadFile,
   /* 0x0e */ syscall::DemandPages,
   /* 0x0f */ syscall::MapFile,
+  /* 0x10 */ syscall::UnmapFile,
+  /* 0x11 */ syscall::MapMemory,
+  /* 0x12 */ syscall::UnmapMemory,
+  /* 0x13 */ syscall::CreateHRTimer,
+  /* 0x14 */ syscall::CancelTimer,
 };
 
 void InitializeSyscall() {
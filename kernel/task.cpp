@@ -10,7 +10,9 @@
 #include "asmfunc.h"
 #include "message.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "timer.hpp"
+#include "zero_pool.hpp"
 
 namespace {
   template <class T, class U>
@@ -19,11 +21,33 @@ namespace {
     c.erase(it, c.end());
   }
 
-  void TaskIdle(uint64_t task_id, int64_t data) {
-    while (true) __asm__("hlt");
+  /** @brief Runs when no other task is runnable, zeroing frames for
+   * the zeroed frame pool until it is full.
+   *
+   * The kernel lock is released while halting so that other processors
+   * can run kernel code in the meantime.
+   */
+  [[noreturn]] void TaskIdle(uint64_t task_id, int64_t data) {
+    while (true) {
+      if (RefillZeroPool()) {
+        continue;
+      }
+      __asm__("cli");
+      ReleaseKernelLock();
+      __asm__("sti\n\thlt\n\tcli");
+      AcquireKernelLock();
+      __asm__("sti");
+    }
   }
 } // namespace
 
+/** @brief Makes the next RestoreContext load CR3 without the no-flush bit.
+ * Set with the kernel lock held right before switching to a task that
+ * last ran on another processor.
+ */
+extern "C" bool cr3_flush_next;
+bool cr3_flush_next = false;
+
 Task::Task(uint64_t id) : id_{id}, msgs_{} {
 }
 
@@ -114,61 +138,127 @@ void Task::SetFileMapEnd(uint64_t v) {
   file_map_end_ = v;
 }
 
-std::vector<FileMapping> &Task::FileMaps() {
+FileMappingMap &Task::FileMaps() {
   return file_maps_;
 }
 
+AnonMappingMap &Task::AnonMaps() {
+  return anon_maps_;
+}
+
+std::map<uint64_t, uint64_t> &Task::FreeFileMapRanges() {
+  return free_file_map_ranges_;
+}
+
+uint64_t Task::StackBegin() const {
+  return stack_begin_;
+}
+
+void Task::SetStackBegin(uint64_t v) {
+  stack_begin_ = v;
+}
+
+uint64_t Task::StackLimit() const {
+  return stack_limit_;
+}
+
+void Task::SetStackLimit(uint64_t v) {
+  stack_limit_ = v;
+}
+
+FaultAroundState &Task::FaultAround() {
+  return fault_around_;
+}
+
+const AppImage *Task::Image() const {
+  return image_;
+}
+
+void Task::SetImage(const AppImage *image) {
+  image_ = image;
+}
+
 TaskManager::TaskManager() {
+  auto &q = cpus_[0];
+  q.online = true;
+
   Task &task = NewTask()
-    .SetLevel(current_level_)
+    .SetLevel(q.current_level)
     .SetRunning(true);
-  running_[current_level_].push_back(&task);
+  task.last_cpu_ = 0;
+  q.running[q.current_level].push_back(&task);
 
   Task &idle = NewTask()
     .InitContext(TaskIdle, 0)
     .SetLevel(0)
     .SetRunning(true);
-  running_[0].push_back(&idle);
+  idle.pinned_ = true;
+  q.idle = &idle;
+  q.running[0].push_back(&idle);
 }
 
 Task &TaskManager::NewTask() {
-  ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  uint32_t slot;
+  if (free_slots_.empty()) {
+    slot = task_slots_.size();
+    task_slots_.emplace_back();
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  auto &s = task_slots_[slot];
+  const uint64_t id = static_cast<uint64_t>(s.generation) << 32 | slot;
+  s.task.reset(new Task{id});
+  return *s.task;
 }
 
 void TaskManager::SwitchTask(const TaskContext &current_ctx) {
-  TaskContext &task_ctx = task_manager->CurrentTask().Context();
+  const int cpu = CurrentCPU();
+  TaskContext &task_ctx = CurrentTask().Context();
   memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-  Task *current_task = RotateCurrentRunQueue(false);
+  if (Load(cpu) == 0) {
+    StealTask(cpu);
+  }
+  Task *current_task = RotateCurrentRunQueue(cpu, false);
   if (&CurrentTask() != current_task) {
-    RestoreContext(&CurrentTask().Context());
+    ++cpus_[cpu].switches;
+    RestoreContext(&PrepareToRun(cpu).Context());
   }
 }
 
 void TaskManager::Sleep(Task *task) {
-  if (!task->Running()) {
+  auto &q = cpus_[task->cpu_];
+  const bool on_cpu = task == q.running[q.current_level].front();
+  const bool on_this_cpu = on_cpu && task->cpu_ == CurrentCPU();
+  if (!task->Running() && !on_this_cpu) {
     return;
   }
 
   task->SetRunning(false);
 
-  if (task == running_[current_level_].front()) {
-    Task *current_task = RotateCurrentRunQueue(true);
-    SwitchContext(&CurrentTask().Context(), &current_task->Context());
+  if (on_this_cpu) {
+    Task *current_task = RotateCurrentRunQueue(task->cpu_, true);
+    SwitchContext(&PrepareToRun(task->cpu_).Context(),
+                  &current_task->Context());
+    return;
+  }
+  if (on_cpu) {
+    // Running on another processor, which drops the task from its run
+    // queue at the next task switch.
     return;
   }
 
-  Erase(running_[task->Level()], task);
+  Erase(q.running[task->Level()], task);
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto &t) { return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task *task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);  
   }
 
-  Sleep(it->get());
+  Sleep(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -182,49 +272,65 @@ void TaskManager::Wakeup(Task *task, int level) {
     level = task->Level();
   }
 
+  if (auto &q = cpus_[task->cpu_]; task == q.running[q.current_level].front()) {
+    // Put to sleep on another processor but not dropped yet, see Sleep
+    task->SetRunning(true);
+    ChangeLevelRunning(task, level);
+    return;
+  }
+
   task->SetLevel(level);
   task->SetRunning(true);
+  if (!task->pinned_) {
+    task->cpu_ = ChooseCPU(*task);
+  }
 
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
+  auto &q = cpus_[task->cpu_];
+  q.running[level].push_back(task);
+  if (level > q.current_level) {
+    q.level_changed = true;
+  }
+  if (Load(task->cpu_) == 1) {
+    // The processor was idle with its timer possibly stopped.
+    KickTaskTimer(task->cpu_);
   }
   return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto &t) { return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task *task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(it->get(), level);
+  Wakeup(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message &msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto &t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  Task *task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
-  (*it)->SendMessage(msg);
+  task->SendMessage(msg);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Task &TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  auto &q = cpus_[CurrentCPU()];
+  return *q.running[q.current_level].front();
 }
 
 void TaskManager::Finish(int exit_code) {
-  Task *current_task = RotateCurrentRunQueue(true);
+  const int cpu = CurrentCPU();
+  Task *current_task = RotateCurrentRunQueue(cpu, true);
 
   const auto task_id = current_task->ID();
-  auto it = std::find_if(
-      tasks_.begin(), tasks_.end(),
-      [current_task](const auto& t){ return t.get() == current_task; });
-  tasks_.erase(it);
+  const uint32_t slot = task_id & 0xffff'ffffu;
+  cpus_[cpu].finished = std::move(task_slots_[slot].task);
+  ++task_slots_[slot].generation;
+  free_slots_.push_back(slot);
+  timer_manager->CancelTaskTimers(task_id);
 
   finish_tasks_[task_id] = exit_code;
   if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
@@ -233,7 +339,7 @@ void TaskManager::Finish(int exit_code) {
     Wakeup(waiter);
   }
 
-  RestoreContext(&CurrentTask().Context());
+  RestoreContext(&PrepareToRun(cpu).Context());
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
@@ -251,50 +357,98 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
   return { exit_code, MAKE_ERROR(Error::kSuccess) };
 }
 
+void TaskManager::StartCPU(int cpu) {
+  auto &q = cpus_[cpu];
+  Task &idle = NewTask()
+    .SetLevel(0)
+    .SetRunning(true);
+  idle.cpu_ = idle.last_cpu_ = cpu;
+  idle.pinned_ = true;
+  q.current_level = 0;
+  q.idle = &idle;
+  q.running[0].push_back(&idle);
+  q.online = true;
+
+  // The context of the idle task is saved when it is first switched out.
+  TaskIdle(idle.ID(), 0);
+}
+
+size_t TaskManager::Load(int cpu) const {
+  const auto &q = cpus_[cpu];
+  if (!q.online) {
+    return 0;
+  }
+  size_t tasks = 0;
+  for (const auto &level_queue : q.running) {
+    tasks += level_queue.size();
+  }
+  return tasks - 1; // the idle task
+}
+
+Task *TaskManager::FindTask(uint64_t id) {
+  const uint64_t slot = id & 0xffff'ffffu;
+  if (slot == 0 || slot >= task_slots_.size()) {
+    return nullptr;
+  }
+  Task *task = task_slots_[slot].task.get();
+  if (task == nullptr || task->ID() != id) {
+    return nullptr;
+  }
+  return task;
+}
+
+bool TaskManager::IdleWithWork(int cpu) const {
+  const auto &q = cpus_[cpu];
+  return q.online && q.running[q.current_level].front() == q.idle && Load(cpu) > 0;
+}
+
 void TaskManager::ChangeLevelRunning(Task *task, int level) {
   if (level < 0 || level == task->Level()) {
     return;
   }
 
-  if (task != running_[current_level_].front()) {
+  auto &q = cpus_[task->cpu_];
+  if (task != q.running[q.current_level].front()) {
     // change level of other task
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
+    Erase(q.running[task->Level()], task);
+    q.running[level].push_back(task);
     task->SetLevel(level);
-    if (level > current_level_) {
-      level_changed_ = true;
+    if (level > q.current_level) {
+      q.level_changed = true;
     }
     return;
   }
 
   // change level myself
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
+  q.running[q.current_level].pop_front();
+  q.running[level].push_front(task);
   task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
+  if (level >= q.current_level) {
+    q.current_level = level;
   } else {
-    current_level_ = level;
-    level_changed_ = true;
+    q.current_level = level;
+    q.level_changed = true;
   }
 }
 
-Task *TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-  auto &level_queue = running_[current_level_];
+Task *TaskManager::RotateCurrentRunQueue(int cpu, bool current_sleep) {
+  auto &q = cpus_[cpu];
+  auto &level_queue = q.running[q.current_level];
   Task *current_task = level_queue.front();
   level_queue.pop_front();
-  if (!current_sleep) {
+  // A task put to sleep from another processor leaves the queue here.
+  if (!current_sleep && current_task->Running()) {
     level_queue.push_back(current_task);
   }
   if (level_queue.empty()) {
-    level_changed_ = true;
+    q.level_changed = true;
   }
 
-  if (level_changed_) {
-    level_changed_ = false;
+  if (q.level_changed) {
+    q.level_changed = false;
     for (int lv = kMaxLevel; lv >= 0; --lv) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
+      if (!q.running[lv].empty()) {
+        q.current_level = lv;
         break;
       }
     }
@@ -303,18 +457,86 @@ Task *TaskManager::RotateCurrentRunQueue(bool current_sleep) {
   return current_task;
 }
 
+/** @brief Picks the processor with the fewest runnable tasks,
+ * preferring the one the task ran on last for its warm caches.
+ */
+int TaskManager::ChooseCPU(const Task &task) const {
+  int best = cpus_[task.cpu_].online ? task.cpu_ : 0;
+  for (int cpu = 0; cpu < kMaxCPUs; ++cpu) {
+    if (cpus_[cpu].online && Load(cpu) < Load(best)) {
+      best = cpu;
+    }
+  }
+  return best;
+}
+
+/** @brief Moves a waiting task of the busiest processor to cpu,
+ * which has nothing but its idle task to run.
+ */
+void TaskManager::StealTask(int cpu) {
+  int busiest = -1;
+  size_t max_load = 1; // a single task is running, not waiting
+  for (int c = 0; c < kMaxCPUs; ++c) {
+    if (c != cpu && Load(c) > max_load) {
+      busiest = c;
+      max_load = Load(c);
+    }
+  }
+  if (busiest < 0) {
+    return;
+  }
+
+  auto &from = cpus_[busiest];
+  const Task *running = from.running[from.current_level].front();
+  for (int lv = kMaxLevel; lv >= 0; --lv) {
+    auto &level_queue = from.running[lv];
+    auto it = std::find_if(
+        level_queue.begin(), level_queue.end(), [running](const Task *t) {
+          return t != running && !t->pinned_ && t->Running();
+        });
+    if (it == level_queue.end()) {
+      continue;
+    }
+
+    Task *task = *it;
+    level_queue.erase(it);
+    task->cpu_ = cpu;
+    auto &to = cpus_[cpu];
+    to.running[lv].push_back(task);
+    if (lv > to.current_level) {
+      to.level_changed = true;
+    }
+    ++to.steals;
+    return;
+  }
+}
+
+/** @brief Returns the task to be switched to on cpu. */
+Task &TaskManager::PrepareToRun(int cpu) {
+  auto &q = cpus_[cpu];
+  Task &next = *q.running[q.current_level].front();
+  if (next.last_cpu_ != cpu) {
+    // The TLB of this processor may hold stale entries of the PCID.
+    cr3_flush_next = next.last_cpu_ >= 0;
+    next.last_cpu_ = cpu;
+  }
+  return next;
+}
+
 TaskManager *task_manager;
 
 void InitializeTask() {
   task_manager = new TaskManager;
 
   __asm__("cli");
-  timer_manager->AddTimer(
-    Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
+  KickTaskTimer(0); // the main task needs time slices from now on
   __asm__("sti");
 }
 
 __attribute__((no_caller_saved_registers))
 extern "C" uint64_t GetCurrentTaskOSStackPointer() {
+  // SyscallEntry calls this with interrupts disabled and releases the lock
+  // before returning to the application.
+  AcquireKernelLock();
   return task_manager->CurrentTask().OSStackPointer();
 }
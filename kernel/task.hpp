@@ -12,6 +12,8 @@
 #include "fat.hpp"
 #include "file.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00
@@ -23,6 +25,8 @@ struct TaskContext {
 
 using TaskFunc = void (uint64_t, int64_t);
 
+union PageMapEntry;
+
 class TaskManager;
 
 struct FileMapping {
@@ -30,7 +34,51 @@ struct FileMapping {
   uint64_t vaddr_begin, vaddr_end;
 };
 
-class Task {
+/** @brief File mappings keyed by vaddr_end.
+ * Since mappings don't overlap, upper_bound(addr) finds the only mapping
+ * that may contain addr.
+ */
+using FileMappingMap = std::map<uint64_t, FileMapping>;
+
+/** @brief An anonymous mapping made by SyscallMapMemory. */
+struct AnonMapping {
+  uint64_t vaddr_begin, vaddr_end;
+  bool huge; // prefers 2 MiB pages; the range is 2 MiB aligned
+};
+
+/** @brief Anonymous mappings keyed by vaddr_end like FileMappingMap. */
+using AnonMappingMap = std::map<uint64_t, AnonMapping>;
+
+/** @brief A PT_LOAD segment of an application */
+struct LoadSegment {
+  uint64_t vaddr, mem_bytes;          // p_vaddr, p_memsz
+  uint64_t file_offset, file_bytes;   // p_offset, p_filesz
+};
+
+/** @brief An application executable whose segments are loaded on demand.
+ *
+ * HandlePageFault loads a touched page of a segment into template_pml4,
+ * zero-filling the part beyond the file content, and maps it read-only
+ * to the faulting task. The template keeps the page, so later runs of
+ * the application share it from the start. Since the template holds a
+ * reference, any write to the page, including one by the kernel on behalf
+ * of a syscall, goes through CopyOnePage and never reaches the shared
+ * frame (apps/segcheck checks this).
+ */
+struct AppImage {
+  fat::DirectoryEntry *file;
+  PageMapEntry *template_pml4;
+  std::vector<LoadSegment> segments;
+};
+
+/** @brief Fault-around state of a task, see HandlePageFault. */
+struct FaultAroundState {
+  uint64_t next_addr{0};   // address of the next fault if access is sequential
+  size_t window_pages{1};  // pages to map on the next sequential fault
+  size_t last_pages{0};    // pages mapped by the last fault
+};
+
+class Task : public SlabObject<Task> {
   public:
     static const int kDefaultLevel = 1;
     static const size_t kDefaultStackBytes = 8 * 4096;
@@ -51,7 +99,19 @@ class Task {
     void SetDPagingEnd(uint64_t v);
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
-    std::vector<FileMapping> &FileMaps();
+    FileMappingMap &FileMaps();
+    AnonMappingMap &AnonMaps();
+    /** @brief Unmapped ranges below FileMapEnd, begin to end */
+    std::map<uint64_t, uint64_t> &FreeFileMapRanges();
+    /** @brief The lowest mapped address of the application stack */
+    uint64_t StackBegin() const;
+    void SetStackBegin(uint64_t v);
+    /** @brief The lowest address the application stack may grow to */
+    uint64_t StackLimit() const;
+    void SetStackLimit(uint64_t v);
+    FaultAroundState &FaultAround();
+    const AppImage *Image() const;
+    void SetImage(const AppImage *image);
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
@@ -61,13 +121,21 @@ class Task {
     std::vector<uint64_t> stack_;
     alignas(16) TaskContext context_;
     uint64_t os_stack_ptr_;
-    std::deque<Message> msgs_;
+    std::deque<Message, SlabAllocator<Message>> msgs_;
     unsigned int level_{kDefaultLevel};
     bool running_{false};
     std::vector<std::shared_ptr<::FileDescriptor>> files_{};
     uint64_t dpaging_begin_{0}, dpaging_end_{0};
     uint64_t file_map_end_{0};
-    std::vector<FileMapping> file_maps_{};
+    uint64_t stack_begin_{0}, stack_limit_{0};
+    FileMappingMap file_maps_{};
+    AnonMappingMap anon_maps_{};
+    std::map<uint64_t, uint64_t> free_file_map_ranges_{};
+    FaultAroundState fault_around_{};
+    const AppImage *image_{nullptr};
+    int cpu_{0};         // processor whose run queue holds the task
+    int last_cpu_{-1};   // processor the task last ran on
+    bool pinned_{false}; // never moved to another processor
 
     Task &SetLevel(int level) { level_ = level; return *this; }
     Task &SetRunning(bool running) { running_ = running; return *this; }
@@ -92,17 +160,62 @@ class TaskManager {
     void Finish(int exit_code);
     WithError<int> WaitFinish(uint64_t task_id);
 
+    /** @brief Makes the caller the idle task of an application processor
+     * and runs the idle loop.
+     */
+    [[noreturn]] void StartCPU(int cpu);
+
+    /** @brief Returns the number of runnable tasks of a processor,
+     * not counting its idle task.
+     */
+    size_t Load(int cpu) const;
+    /** @brief Returns whether cpu runs its idle task while having
+     * other tasks to run, i.e. should switch tasks right away.
+     */
+    bool IdleWithWork(int cpu) const;
+    size_t Switches(int cpu) const { return cpus_[cpu].switches; }
+    size_t Steals(int cpu) const { return cpus_[cpu].steals; }
+
   private:
-    std::vector<std::unique_ptr<Task>> tasks_{};
-    uint64_t latest_id_{0};
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-    int current_level_{kMaxLevel};
-    bool level_changed_{false};
+    /** @brief The run queues of a processor */
+    struct CPURunQueue {
+      std::array<std::deque<Task*>, kMaxLevel + 1> running{};
+      int current_level{kMaxLevel};
+      bool level_changed{false};
+      bool online{false};
+      Task *idle{nullptr};
+      size_t switches{0}; // task switches made by the timer
+      size_t steals{0};   // tasks taken from other processors
+      /** @brief The task that last finished on this processor. Finish
+       * runs on the stack of the task until RestoreContext leaves it, so
+       * the task is freed when the next one finishes here.
+       */
+      std::unique_ptr<Task> finished{};
+    };
+
+    /** @brief A slot of the task table.
+     * A task ID is the slot index in the low 32 bits and the generation
+     * of the slot in the high 32 bits. The generation is bumped when the
+     * task finishes, so IDs of finished tasks never match a later task
+     * reusing the slot.
+     */
+    struct TaskSlot {
+      std::unique_ptr<Task> task;
+      uint32_t generation;
+    };
+
+    std::vector<TaskSlot> task_slots_ = std::vector<TaskSlot>(1); // slot 0: no task
+    std::vector<uint32_t> free_slots_{};
+    std::array<CPURunQueue, kMaxCPUs> cpus_{};
     std::map<uint64_t, int> finish_tasks_{}; // key: ID of a finished task
     std::map<uint64_t, Task*> finish_waiter_{}; // key: ID of a finished task
 
+    Task *FindTask(uint64_t id);
     void ChangeLevelRunning(Task *task, int level);
-    Task *RotateCurrentRunQueue(bool current_sleep);
+    Task *RotateCurrentRunQueue(int cpu, bool current_sleep);
+    int ChooseCPU(const Task &task) const;
+    void StealTask(int cpu);
+    Task &PrepareToRun(int cpu);
 };
 
 extern TaskManager *task_manager;
@@ -1,7 +1,9 @@
 #include "terminal.hpp"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <optional>
@@ -12,16 +14,23 @@
 #include "fat.hpp"
 #include "font.hpp"
 #include "graphics.hpp"
+#include "heap.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
 #include "message.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "reclaim.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "swap.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 #include "window.hpp"
+#include "zero_pool.hpp"
 
 namespace {
 
@@ -91,34 +100,29 @@ uintptr_t GetFirstLoadAddress(Elf64_Ehdr *ehdr) {
   return 0;
 }
 
-static_assert(kBytesPerFrame >= 4096);
-
-WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr *ehdr) {
+/** @brief Records the PT_LOAD segments in image.
+ * Nothing is loaded here; HandlePageFault loads a page on first touch.
+ */
+WithError<uint64_t> RegisterLoadSegments(Elf64_Ehdr *ehdr, AppImage &image) {
   auto phdr = GetProgramHeader(ehdr);
   uint64_t last_addr = 0;
   for (int i = 0; i < ehdr->e_phnum; ++i) {
     if (phdr[i].p_type != PT_LOAD) continue;
-
-    LinearAddress4Level dest_addr;
-    dest_addr.value = phdr[i].p_vaddr;
-    last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
-    const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
-
-    // set up pagemaps as read only (writable = false)
-    if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
-      return { last_addr, err };
+    if (phdr[i].p_filesz > phdr[i].p_memsz ||
+        phdr[i].p_offset + phdr[i].p_filesz > image.file->file_size) {
+      return { last_addr, MAKE_ERROR(Error::kInvalidFormat) };
     }
 
-    const auto src = reinterpret_cast<uint8_t*>(ehdr) + phdr[i].p_offset;
-    const auto dst = reinterpret_cast<uint8_t*>(phdr[i].p_vaddr);
-    memcpy(dst, src, phdr[i].p_filesz);
-    memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
+    last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
+    image.segments.push_back(LoadSegment{
+      phdr[i].p_vaddr, phdr[i].p_memsz, phdr[i].p_offset, phdr[i].p_filesz
+    });
   }
   return { last_addr, MAKE_ERROR(Error::kSuccess) };
 }
 
 // Properly places the LOAD segment in the ELF file.
-WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr) {
+WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr, AppImage &image) {
   if (ehdr->e_type != ET_EXEC) {
     return { 0, MAKE_ERROR(Error::kInvalidFormat) };
   }
@@ -128,7 +132,7 @@ WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr) {
     return { 0, MAKE_ERROR(Error::kInvalidFormat) };
   }
 
-  return CopyLoadSegments(ehdr);
+  return RegisterLoadSegments(ehdr, image);
 }
 
 WithError<PageMapEntry*> SetupPML4(Task &current_task) {
@@ -137,21 +141,31 @@ WithError<PageMapEntry*> SetupPML4(Task &current_task) {
     return pml4;
   }
 
-  const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
-  memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
+  memcpy(pml4.value, CurrentPML4(), 256 * sizeof(uint64_t));
 
-  const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+  auto [ cr3, err ] = NewCR3(pml4.value);
+  if (err) {
+    FreePageMap(pml4.value);
+    return { nullptr, err };
+  }
+  // Loading without the no-flush bit drops whatever a previous owner of
+  // the PCID left in the TLB.
   SetCR3(cr3);
   current_task.Context().cr3 = cr3;
   return pml4;
 }
 
+/** @brief Detaches the application address space from the task.
+ * The reclaim task frees it later, so the terminal doesn't wait for it.
+ */
 Error FreePML4(Task &current_task) {
   const auto cr3 = current_task.Context().cr3;
   current_task.Context().cr3 = 0;
   ResetCR3();
+  ReleaseCR3(cr3);
 
-  return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+  ReclaimPageMap(reinterpret_cast<PageMapEntry*>(cr3 & ~0xffful));
+  return MAKE_ERROR(Error::kSuccess);
 }
 
 void ListAllEntries(FileDescriptor &fd, uint32_t dir_cluster) {
@@ -194,27 +208,44 @@ WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry &file_entry, Task &task) {
     return { app_load, err };
   }
 
-  std::vector<uint8_t> file_buf(file_entry.file_size);
-  fat::LoadFile(&file_buf[0], file_buf.size(), file_entry);
-
-  auto elf_header = reinterpret_cast<Elf64_Ehdr*>(&file_buf[0]);
+  // Only the ELF header and the program headers are read here.
+  std::vector<uint8_t> header_buf(sizeof(Elf64_Ehdr));
+  if (fat::LoadFile(&header_buf[0], header_buf.size(), file_entry)
+      != header_buf.size()) {
+    return { {}, MAKE_ERROR(Error::kInvalidFile) };
+  }
+  auto elf_header = reinterpret_cast<Elf64_Ehdr*>(&header_buf[0]);
   if (memcmp(elf_header->e_ident, "\x7f" "ELF", 4) != 0) {
     return { {}, MAKE_ERROR(Error::kInvalidFile) };
   }
 
-  auto [ last_addr, err_load ] = LoadELF(elf_header);
+  const size_t header_bytes =
+    elf_header->e_phoff + elf_header->e_phnum * sizeof(Elf64_Phdr);
+  if (header_bytes > file_entry.file_size) {
+    return { {}, MAKE_ERROR(Error::kInvalidFile) };
+  }
+  header_buf.resize(header_bytes);
+  fat::LoadFile(&header_buf[0], header_buf.size(), file_entry);
+  elf_header = reinterpret_cast<Elf64_Ehdr*>(&header_buf[0]);
+
+  auto image = new AppImage{&file_entry, temp_pml4, {}};
+  auto [ last_addr, err_load ] = LoadELF(elf_header, *image);
   if (err_load) {
+    delete image;
     return { {}, err_load };
   }
 
-  AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
+  AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4, image};
   app_loads->insert(std::make_pair(&file_entry, app_load));
 
+  // The template keeps its page map but not its PCID.
+  const auto temp_cr3 = GetCR3();
   if (auto [ pml4, err ] = SetupPML4(task); err) {
     return { app_load, err };
   } else {
     app_load.pml4 = pml4;
   }
+  ReleaseCR3(temp_cr3);
   auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
   return { app_load, err };
 }
@@ -256,12 +287,12 @@ Terminal::Terminal(Task& task, const TerminalDescriptor *term_desc)
   } else {
     show_window_ = true;
     for (int i = 0; i < files_.size(); ++i) {
-      files_[i] = std::make_shared<TerminalFileDescriptor>(*this);
+      files_[i] = MakeSlabShared<TerminalFileDescriptor>(*this);
     }
   }
   
   if (show_window_) {
-    window_ = std::make_shared<ToplevelWindow>(
+    window_ = MakeSlabShared<ToplevelWindow>(
       kColumns * 8 + 8 + ToplevelWindow::kMarginX,
       kRows * 16 + 8 + ToplevelWindow::kMarginY,
       screen_config.pixel_format,
@@ -399,7 +430,7 @@ void Terminal::ExecuteLine() {
       PrintToFD(*files_[2], "cannot redirect to a directory\n");
       return;
     }
-    files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+    files_[1] = MakeSlabShared<fat::FileDescriptor>(*file);
   }
 
   std::shared_ptr<PipeDescriptor> pipe_fd;
@@ -413,7 +444,7 @@ void Terminal::ExecuteLine() {
     }
 
     auto &subtask = task_manager->NewTask();
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+    pipe_fd = MakeSlabShared<PipeDescriptor>(subtask);
     auto term_desc = new TerminalDescriptor{
       subcommand, true, false,
       { pipe_fd, files_[1], files_[2] }
@@ -487,7 +518,7 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[2], "%s is not a directory\n", name);
         exit_code = 1;
       } else {
-        fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+        fd = MakeSlabShared<fat::FileDescriptor>(*file_entry);
       }
     }
       if (fd) {
@@ -516,6 +547,86 @@ void Terminal::ExecuteLine() {
     PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
         p_stat.total_frames,
         p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+
+    const auto h_stat = GetHeapStat();
+    PrintToFD(*files_[1], "Heap mapped: %lu KiB (%lu huge pages)\n",
+        h_stat.mapped_bytes / 1024, h_stat.huge_pages);
+    PrintToFD(*files_[1], "Heap used  : %lu KiB\n", h_stat.in_use_bytes / 1024);
+    PrintToFD(*files_[1], "Heap free  : %lu KiB in %lu chunks (%lu KiB at top)\n",
+        h_stat.free_bytes / 1024, h_stat.free_chunks,
+        h_stat.top_free_bytes / 1024);
+    // fragmentation: free memory that can't be trimmed, relative to all free memory
+    const auto inner_free = h_stat.free_bytes - h_stat.top_free_bytes;
+    PrintToFD(*files_[1], "Heap frag  : %lu%%\n",
+        h_stat.free_bytes == 0 ? 0 : inner_free * 100 / h_stat.free_bytes);
+
+    const auto r_stat = GetReclaimStat();
+    PrintToFD(*files_[1], "Reclaim    : %lu spaces pending, %lu freed (%lu frames in %lu ranges)\n",
+        r_stat.pending_spaces, r_stat.spaces, r_stat.frames, r_stat.free_calls);
+    const auto z_stat = GetZeroPoolStat();
+    PrintToFD(*files_[1], "Zero pool  : %lu frames, %lu hits, %lu misses, %lu zeroed, %lu drained\n",
+        z_stat.frames, z_stat.hits, z_stat.misses, z_stat.refills, z_stat.drained);
+    const auto c_stat = GetPageCacheStat();
+    PrintToFD(*files_[1], "Page cache : %lu pages, %lu hits, %lu misses, %lu evicted\n",
+        c_stat.pages, c_stat.hits, c_stat.misses, c_stat.evictions);
+  } else if (strcmp(command, "slabstat") == 0) {
+    PrintToFD(*files_[1], " size  active   total slabs     allocs name\n");
+    for (auto cache = FirstSlabCache(); cache; cache = cache->Next()) {
+      const auto s_stat = cache->Stat();
+      // type caches are named after __PRETTY_FUNCTION__ of TypeCache<T>
+      const char *name = cache->Name();
+      if (const char *type = strstr(name, "T = ")) {
+        name = type + 4;
+      }
+      PrintToFD(*files_[1], "%5lu %7lu %7lu %5lu %10lu %.40s\n",
+          s_stat.object_bytes, s_stat.active_objects, s_stat.total_objects,
+          s_stat.slabs, s_stat.allocs, name);
+    }
+  } else if (strcmp(command, "faultaround") == 0) {
+    if (first_arg) {
+      fault_around_max_pages = std::max(atoi(first_arg), 1);
+    }
+    const auto f_stat = GetFaultAroundStat();
+    PrintToFD(*files_[1], "Max window  : %lu pages\n", fault_around_max_pages);
+    PrintToFD(*files_[1], "Faults      : %lu (%lu pages mapped)\n",
+        f_stat.faults, f_stat.mapped_pages);
+    PrintToFD(*files_[1], "Saved faults: %lu\n", f_stat.saved_faults);
+  } else if (strcmp(command, "swap") == 0) {
+    if (first_arg) {
+      swap_low_free_frames = atoi(first_arg);
+    }
+    const auto s_stat = GetSwapStat();
+    PrintToFD(*files_[1], "Low watermark: %lu free frames\n", swap_low_free_frames);
+    PrintToFD(*files_[1], "Stored       : %lu pages, %lu bytes compressed, %lu bytes allocated (%lu%% of the original)\n",
+        s_stat.stored_pages, s_stat.compressed_bytes, s_stat.stored_bytes,
+        s_stat.stored_pages ? s_stat.stored_bytes * 100 / (s_stat.stored_pages * 4096) : 0);
+    PrintToFD(*files_[1], "Swapped out  : %lu pages (%lu incompressible)\n",
+        s_stat.swap_outs, s_stat.rejected);
+    PrintToFD(*files_[1], "Swapped in   : %lu pages, %lu cycles each\n",
+        s_stat.swap_ins, s_stat.swap_ins ? s_stat.swap_in_cycles / s_stat.swap_ins : 0);
+  } else if (strcmp(command, "cpus") == 0) {
+    for (int cpu = 0; cpu < NumCPUs(); ++cpu) {
+      PrintToFD(*files_[1], "CPU %d: APIC ID %u, %lu runnable, %lu switches, %lu steals, %lu timer interrupts\n",
+          cpu, APICIDOf(cpu), task_manager->Load(cpu),
+          task_manager->Switches(cpu), task_manager->Steals(cpu),
+          TimerInterrupts(cpu));
+    }
+    const auto smp_stat = GetSMPStat();
+    PrintToFD(*files_[1], "Kernel lock: %lu acquires, %lu spins\n",
+        smp_stat.lock_acquires, smp_stat.lock_spins);
+    PrintToFD(*files_[1], "Kernel unmaps: %lu\n", smp_stat.kernel_unmaps);
+  } else if (strcmp(command, "timerstat") == 0) {
+    const auto t_stat = timer_manager->Stat();
+    PrintToFD(*files_[1], "TSC: %lu Hz, uptime %lu us\n",
+        TSCFrequency(), CurrentNanoseconds() / 1000);
+    PrintToFD(*files_[1], "Timers fired: %lu, lateness avg %lu ns, max %lu ns\n",
+        t_stat.fired, t_stat.fired == 0 ? 0 : t_stat.total_late_ns / t_stat.fired,
+        t_stat.max_late_ns);
+  } else if (strcmp(command, "stacklimit") == 0) {
+    if (first_arg) {
+      app_stack_max_pages = std::max(atoi(first_arg), 2);
+    }
+    PrintToFD(*files_[1], "Max app stack: %lu pages\n", app_stack_max_pages);
   } else if (command[0] != 0) {
     auto file_entry = FindCommand(command);
     if (!file_entry) {
@@ -554,6 +665,8 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
   auto &task = task_manager->CurrentTask();
   __asm__("sti");
 
+  // exec-to-start latency, logged below
+  const uint64_t exec_tsc = __builtin_ia32_rdtsc();
   auto [ app_load, err ] = LoadApp(file_entry, task);
   if (err) {
     return { 0, err };
@@ -577,11 +690,14 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
   // #@@range_end(arrange_args)
 
   // #@@range_begin(call_app)
-  const int stack_size = 16 * 4096;
-  LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'f000 - stack_size};
-  if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+  // Only the top of the stack is mapped, it grows on page faults.
+  const uint64_t stack_limit = kAppStackTop - app_stack_max_pages * 4096;
+  LinearAddress4Level stack_frame_addr{kAppStackTop - kAppStackInitialPages * 4096};
+  if (auto err = SetupPageMaps(stack_frame_addr, kAppStackInitialPages)) {
     return { 0, err };
   }
+  task.SetStackBegin(stack_frame_addr.value);
+  task.SetStackLimit(stack_limit);
 
   for (int i = 0; i < files_.size(); ++i) {
     task.Files().push_back(files_[i]);
@@ -593,22 +709,32 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
   task.SetDPagingBegin(elf_next_page);
   task.SetDPagingEnd(elf_next_page);
 
-  task.SetFileMapEnd(stack_frame_addr.value);
+  // Leave an unmapped guard page below the stack limit.
+  task.SetFileMapEnd(stack_limit - 4096);
+  task.SetImage(app_load.image);
+  Log(kInfo, "%s: %lu cycles from exec to the app start\n",
+      command, __builtin_ia32_rdtsc() - exec_tsc);
 
   int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
   // #@@range_end(set_dp_range)
-                    stack_frame_addr.value + stack_size - 8,
+                    kAppStackTop - 8,
                     &task.OSStackPointer());
   // #@@range_end(call_app)
 
+  const uint64_t exit_tsc = __builtin_ia32_rdtsc();
+  task.SetImage(nullptr);
   task.Files().clear();
   task.FileMaps().clear();
+  task.AnonMaps().clear();
+  task.FreeFileMapRanges().clear();
+  __asm__("cli");
+  timer_manager->CancelAppTimers(task.ID());
+  __asm__("sti");
 
-  if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-    return { ret, err };
-  }
-
-  return { ret, FreePML4(task) };
+  auto err_free = FreePML4(task);
+  Log(kInfo, "%s: %lu cycles from exit to the prompt\n",
+      command, __builtin_ia32_rdtsc() - exit_tsc);
+  return { ret, err_free };
 }
 
 void Terminal::Print(char32_t c) {
@@ -738,11 +864,12 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     task_manager->Finish(terminal->LastExitCode());
   }
 
-  auto add_blink_timer = [task_id](unsigned long t) {
-    timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5),
-                            1, task_id});
-  };
-  add_blink_timer(timer_manager->CurrentTick());
+  const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
+  __asm__("cli");
+  timer_manager->AddTimer(
+    Timer{timer_manager->CurrentTick() + kTimer05Sec, 1, task_id}
+      .SetPeriod(kTimer05Sec * kNanosecondsPerTick, kTimer05Sec));
+  __asm__("sti");
 
   bool window_isactive = false;
 
@@ -758,7 +885,6 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
 
     switch (msg->type) {
       case Message::kTimerTimeout:
-        add_blink_timer(msg->arg.timer.timeout);
         if (show_window && window_isactive) {
           const auto area = terminal->BlinkCursor();
           Message msg = MakeLayerMessage(
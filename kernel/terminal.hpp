@@ -19,6 +19,7 @@
 struct AppLoadInfo {
   uint64_t vaddr_end, entry;
   PageMapEntry *pml4;
+  AppImage *image;
 };
 
 extern std::map<fat::DirectoryEntry*, AppLoadInfo> *app_loads;
@@ -1,18 +1,125 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cpuid.h>
 #include <limits>
 
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "logger.hpp"
 #include "message.hpp"
+#include "msr.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
+  const uint64_t kNoDeadline = std::numeric_limits<uint64_t>::max();
   volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  /** @brief Whether the local APIC timer is armed through IA32_TSC_DEADLINE
+   * rather than one-shot counts.
+   */
+  bool use_tsc_deadline = false;
+
+  // The TSC is the clock, counting from tsc_base. Conversions between TSC
+  // cycles and nanoseconds multiply by 32.32 fixed-point factors.
+  uint64_t tsc_freq;
+  uint64_t tsc_base;
+  uint64_t ns_per_tsc; // nanoseconds per TSC cycle << 32
+  uint64_t tsc_per_ns; // TSC cycles per nanosecond << 32
+  uint64_t tsc_per_slice;
+
+  // Per processor: TSC value the running task's time slice ends at, and
+  // the number of timer interrupts taken.
+  std::array<uint64_t, kMaxCPUs> slice_end{};
+  std::array<unsigned long, kMaxCPUs> interrupts{};
+
+  bool SupportsTSCDeadline() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (ecx >> 24) & 1; // TSC-Deadline
+  }
+
+  /** @brief Returns the TSC value at ns, saturating to kNoDeadline. */
+  uint64_t TSCOfNanoseconds(uint64_t ns) {
+    const auto tsc = (static_cast<unsigned __int128>(ns) * tsc_per_ns >> 32) + tsc_base;
+    return tsc >= kNoDeadline ? kNoDeadline : static_cast<uint64_t>(tsc);
+  }
+
+  /** @brief Measures the frequencies of the local APIC timer and the TSC
+   * over 100 ms of the ACPI PM timer.
+   */
+  void CalibrateTimers() {
+    const uint32_t pm_mask = (acpi::fadt->flags >> 8) & 1 ? 0xffff'ffffu : 0x00ff'ffffu;
+    const auto pm_tmr_blk = acpi::fadt->pm_tmr_blk;
+
+    // Start both counters right after a PM timer edge and read them right
+    // after another, so that the interval is known to a PM timer cycle.
+    const uint32_t pm_start = IoIn32(pm_tmr_blk);
+    uint32_t pm_begin;
+    while ((pm_begin = IoIn32(pm_tmr_blk)) == pm_start);
+    const uint64_t tsc_begin = __builtin_ia32_rdtsc();
+    StartLAPICTimer();
+
+    uint32_t pm_elapsed;
+    uint32_t lapic_elapsed;
+    uint64_t tsc_end;
+    do {
+      const uint32_t pm_now = IoIn32(pm_tmr_blk);
+      lapic_elapsed = LAPICTimerElapsed();
+      tsc_end = __builtin_ia32_rdtsc();
+      pm_elapsed = (pm_now - pm_begin) & pm_mask;
+    } while (pm_elapsed < acpi::kPMTimerFreq / 10);
+    StopLAPICTimer();
+
+    lapic_timer_freq = static_cast<uint64_t>(lapic_elapsed) * acpi::kPMTimerFreq / pm_elapsed;
+    tsc_freq = (tsc_end - tsc_begin) * acpi::kPMTimerFreq / pm_elapsed;
+  }
+
+  /** @brief Programs the local APIC timer of the running processor to fire
+   * at deadline (TSC), or stops it if deadline is kNoDeadline.
+   */
+  void ProgramTimer(uint64_t deadline, uint64_t now) {
+    if (use_tsc_deadline) {
+      // A deadline in the past fires at once, 0 disarms the timer.
+      WriteMSR(kIA32_TSC_DEADLINE, deadline == kNoDeadline ? 0 : deadline);
+      return;
+    }
+    if (deadline == kNoDeadline) {
+      initial_count = 0;
+      return;
+    }
+    // Deadlines beyond a second fire early and are simply programmed again.
+    const uint64_t delta = deadline <= now ? 0 : std::min(deadline - now, tsc_freq);
+    const uint64_t count = delta * lapic_timer_freq / tsc_freq;
+    initial_count = std::clamp<uint64_t>(count, 1, kCountMax);
+  }
+
+  /** @brief Arms the timer of cpu (the running processor) for the earliest
+   * of the end of its time slice and, on the bootstrap processor, the next
+   * timeout of timer_manager.
+   *
+   * A processor with nothing but its idle task to run needs no time slice,
+   * so it isn't interrupted at all while no timer is pending.
+   */
+  void ArmTimer(int cpu, uint64_t now) {
+    uint64_t deadline = kNoDeadline;
+    if (task_manager && task_manager->Load(cpu) > 0) {
+      deadline = slice_end[cpu];
+    }
+    if (cpu == 0) {
+      deadline = std::min(deadline, TSCOfNanoseconds(timer_manager->NextDeadline()));
+    }
+    ProgramTimer(deadline, now);
+  }
 } //namespace
 
 void InitializeLAPICTimer() {
@@ -21,16 +128,50 @@ void InitializeLAPICTimer() {
   divide_config = 0b1011; // divide 1:1
   lvt_timer = 0b001 << 16; // masked, one-shot
   
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  CalibrateTimers();
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  const uint64_t kNanosecondsPerSecond = 1'000'000'000;
+  ns_per_tsc = (kNanosecondsPerSecond << 32) / tsc_freq;
+  tsc_per_ns = (tsc_freq / kNanosecondsPerSecond << 32) +
+               (tsc_freq % kNanosecondsPerSecond << 32) / kNanosecondsPerSecond;
+  tsc_per_slice = tsc_freq * kTaskTimerPeriod / kTimerFreq;
+  tsc_base = __builtin_ia32_rdtsc();
+  use_tsc_deadline = SupportsTSCDeadline();
+  Log(kInfo, "TSC %lu Hz, local APIC timer %lu Hz%s\n", tsc_freq, lapic_timer_freq,
+      use_tsc_deadline ? ", TSC-deadline mode" : "");
 
+  StartLAPICTimerOnCPU();
+}
+
+void StartLAPICTimerOnCPU() {
   divide_config = 0b1011; // divide 1:1
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-  initial_count = lapic_timer_freq / kTimerFreq;
+  if (use_tsc_deadline) {
+    lvt_timer = (0b10 << 17) | InterruptVector::kLAPICTimer; // not-masked, TSC-deadline
+  } else {
+    lvt_timer = (0b00 << 17) | InterruptVector::kLAPICTimer; // not-masked, one-shot
+  }
+  ArmTimer(CurrentCPU(), __builtin_ia32_rdtsc());
+}
+
+void KickTaskTimer(int cpu) {
+  if (cpu == CurrentCPU()) {
+    ArmTimer(cpu, __builtin_ia32_rdtsc());
+  } else {
+    SendInterrupt(cpu, InterruptVector::kLAPICTimer);
+  }
+}
+
+unsigned long TimerInterrupts(int cpu) {
+  return interrupts[cpu];
+}
+
+uint64_t CurrentNanoseconds() {
+  const uint64_t tsc = __builtin_ia32_rdtsc() - tsc_base;
+  return static_cast<unsigned __int128>(tsc) * ns_per_tsc >> 32;
+}
+
+uint64_t TSCFrequency() {
+  return tsc_freq;
 }
 
 void StartLAPICTimer() {
@@ -46,53 +187,320 @@ void StopLAPICTimer() {
 }
 
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id) 
-    : timeout_{timeout}, value_{value}, task_id_{task_id} {
+    : deadline_ns_{timeout < kNoDeadline / kNanosecondsPerTick ?
+                   timeout * kNanosecondsPerTick : kNoDeadline},
+      timeout_{timeout}, value_{value}, task_id_{task_id} {
+}
+
+Timer::Timer(uint64_t deadline_ns, unsigned long timeout, int value, uint64_t task_id)
+    : deadline_ns_{deadline_ns}, timeout_{timeout}, value_{value}, task_id_{task_id} {
+}
+
+Timer &Timer::SetPeriod(uint64_t period_ns, unsigned long timeout_period) {
+  period_ns_ = period_ns;
+  timeout_period_ = timeout_period;
+  return *this;
+}
+
+void Timer::Rearm(uint64_t now_ns) {
+  const uint64_t periods = (now_ns - deadline_ns_) / period_ns_ + 1;
+  if (deadline_ns_ > kNoDeadline - periods * period_ns_) {
+    deadline_ns_ = kNoDeadline;
+    return;
+  }
+  deadline_ns_ += periods * period_ns_;
+  timeout_ += periods * timeout_period_;
 }
 
 TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+  nodes_.push_back(Node{Timer{0ul, 0, 0}, 0, 0, 0, -1});
 }
 
-void TimerManager::AddTimer(const Timer &timer) {
-  timers_.push(timer);
+TimerHandle TimerManager::AddTimer(const Timer &timer) {
+  const auto next_deadline = NextDeadline();
+
+  uint32_t index;
+  if (free_nodes_.empty()) {
+    index = nodes_.size();
+    nodes_.push_back(Node{timer, 1, 0, 0, -1});
+  } else {
+    index = free_nodes_.back();
+    free_nodes_.pop_back();
+    nodes_[index].timer = timer;
+  }
+  Insert(index);
+
+  if (timer.DeadlineNanoseconds() < next_deadline) {
+    KickTaskTimer(0);
+  }
+  return static_cast<uint64_t>(nodes_[index].generation) << 32 | index;
 }
 
-bool TimerManager::Tick() {
-  ++tick_;
+Error TimerManager::CancelTimer(TimerHandle handle) {
+  const uint32_t index = Find(handle);
+  if (index == 0) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  Unlink(index);
+  Release(index);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error TimerManager::CancelAppTimer(TimerHandle handle, uint64_t task_id) {
+  const uint32_t index = Find(handle);
+  if (index == 0) {
+    return MAKE_ERROR(Error::kNoSuchEntry);
+  }
+  const auto &t = nodes_[index].timer;
+  if (t.TaskID() != task_id || t.Value() >= 0) {
+    return MAKE_ERROR(Error::kNotPermitted);
+  }
+  Unlink(index);
+  Release(index);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+template <class Pred>
+void TimerManager::CancelTimersIf(Pred pred) {
+  for (uint32_t index = 1; index < nodes_.size(); ++index) {
+    if (nodes_[index].bucket >= 0 && pred(nodes_[index].timer)) {
+      Unlink(index);
+      Release(index);
+    }
+  }
+}
+
+void TimerManager::CancelTaskTimers(uint64_t task_id) {
+  CancelTimersIf([task_id](const Timer &t) { return t.TaskID() == task_id; });
+}
+
+void TimerManager::CancelAppTimers(uint64_t task_id) {
+  CancelTimersIf([task_id](const Timer &t) {
+    return t.TaskID() == task_id && t.Value() < 0;
+  });
+}
+
+unsigned long TimerManager::CurrentTick() const {
+  return CurrentNanoseconds() / kNanosecondsPerTick;
+}
+
+uint64_t TimerManager::NextDeadline() const {
+  // The first non-empty slot of a level holds the earliest timers of it,
+  // except for the timers beyond the last level: for them the wheel has to
+  // come to their slot to move them further.
+  uint64_t deadline = kNoDeadline;
+  for (int level = 0; level < kWheelLevels; ++level) {
+    const int slot = FirstSlot(level);
+    if (slot < 0) {
+      continue;
+    }
+    const uint64_t slot_unit = SlotUnit(level, slot);
+    const uint64_t slot_end = slot_unit + (uint64_t{1} << (kWheelBits * level));
+    const int bucket = level * kWheelSlots + slot;
+    for (uint32_t i = heads_[bucket]; i != 0; i = nodes_[i].next) {
+      const uint64_t d = nodes_[i].timer.DeadlineNanoseconds();
+      deadline = std::min(deadline, (d >> kWheelShift) < slot_end ? d : slot_unit << kWheelShift);
+    }
+  }
+  return deadline;
+}
+
+void TimerManager::Tick() {
+  const uint64_t now = CurrentNanoseconds();
+  const uint64_t now_unit = now >> kWheelShift;
+  const uint64_t slot_mask = kWheelSlots - 1;
 
-  bool task_timer_timeout = false;
   while (true) {
-    const auto &t = timers_.top();
-    if (t.Timeout() > tick_) {
+    Expire(wheel_unit_ & slot_mask, now);
+    if (wheel_unit_ >= now_unit) {
       break;
     }
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
+    // Jump to the next slot with timers to expire or to move down a level.
+    uint64_t next_unit = now_unit;
+    for (int level = 0; level < kWheelLevels; ++level) {
+      if (const int slot = FirstSlot(level); slot >= 0) {
+        next_unit = std::min(next_unit, SlotUnit(level, slot));
+      }
+    }
+    wheel_unit_ = next_unit;
+
+    for (int level = 1; level < kWheelLevels; ++level) {
+      const int shift = kWheelBits * level;
+      if (wheel_unit_ & ((uint64_t{1} << shift) - 1)) {
+        break;
+      }
+      for (uint32_t i = TakeSlot(level, (wheel_unit_ >> shift) & slot_mask); i != 0; ) {
+        const uint32_t next = nodes_[i].next;
+        Insert(i);
+        i = next;
+      }
+    }
+  }
+}
+
+uint32_t TimerManager::Find(TimerHandle handle) const {
+  const uint32_t index = handle & 0xffff'ffffu;
+  if (index == 0 || index >= nodes_.size() ||
+      nodes_[index].generation != handle >> 32 || nodes_[index].bucket < 0) {
+    return 0;
+  }
+  return index;
+}
+
+void TimerManager::Insert(uint32_t index) {
+  auto &node = nodes_[index];
+  const uint64_t slot_mask = kWheelSlots - 1;
+  const uint64_t max_delta = (uint64_t{1} << (kWheelBits * kWheelLevels)) - 1;
+
+  uint64_t unit = node.timer.DeadlineNanoseconds() >> kWheelShift;
+  int level = 0;
+  int slot;
+  if (unit <= wheel_unit_) {
+    slot = wheel_unit_ & slot_mask; // expires at the next Tick
+  } else {
+    // Timers beyond the last level wait in its furthest slot.
+    uint64_t delta = unit - wheel_unit_;
+    if (delta > max_delta) {
+      delta = max_delta;
+      unit = wheel_unit_ + max_delta;
+    }
+    while (level < kWheelLevels - 1 && delta >> (kWheelBits * (level + 1))) {
+      ++level;
+    }
+    slot = (unit >> (kWheelBits * level)) & slot_mask;
+  }
+
+  const int bucket = level * kWheelSlots + slot;
+  node.bucket = bucket;
+  node.prev = 0;
+  node.next = heads_[bucket];
+  if (node.next != 0) {
+    nodes_[node.next].prev = index;
+  }
+  heads_[bucket] = index;
+  occupied_[level] |= uint64_t{1} << slot;
+}
+
+void TimerManager::Unlink(uint32_t index) {
+  auto &node = nodes_[index];
+  if (node.prev != 0) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.bucket] = node.next;
+    if (node.next == 0) {
+      occupied_[node.bucket / kWheelSlots] &= ~(uint64_t{1} << (node.bucket % kWheelSlots));
+    }
+  }
+  if (node.next != 0) {
+    nodes_[node.next].prev = node.prev;
+  }
+}
+
+void TimerManager::Release(uint32_t index) {
+  auto &node = nodes_[index];
+  node.bucket = -1;
+  ++node.generation;
+  free_nodes_.push_back(index);
+}
+
+/** @brief Empties a slot and returns the first timer of its former list. */
+uint32_t TimerManager::TakeSlot(int level, int slot) {
+  const int bucket = level * kWheelSlots + slot;
+  const uint32_t head = heads_[bucket];
+  heads_[bucket] = 0;
+  occupied_[level] &= ~(uint64_t{1} << slot);
+  return head;
+}
+
+/** @brief Returns the slot of a level the wheel comes to first among those
+ * with timers, or -1 if the level is empty.
+ * On level 0 the current slot comes first; on the other levels the wheel
+ * has already moved the timers of the current slot down, so it comes last.
+ */
+int TimerManager::FirstSlot(int level) const {
+  const uint64_t bits = occupied_[level];
+  if (bits == 0) {
+    return -1;
+  }
+  const int shift = kWheelBits * level;
+  const int start = ((wheel_unit_ >> shift) + (level > 0)) & (kWheelSlots - 1);
+  const uint64_t rotated = (bits >> start) | (bits << ((kWheelSlots - start) % kWheelSlots));
+  return (start + __builtin_ctzll(rotated)) % kWheelSlots;
+}
+
+/** @brief Returns the unit at which the wheel comes to a slot. */
+uint64_t TimerManager::SlotUnit(int level, int slot) const {
+  const int shift = kWheelBits * level;
+  uint64_t distance = (slot - (wheel_unit_ >> shift)) & (kWheelSlots - 1);
+  if (level > 0 && distance == 0) {
+    distance = kWheelSlots;
+  }
+  return ((wheel_unit_ >> shift) + distance) << shift;
+}
+
+/** @brief Sends the messages of the expired timers in a slot of level 0
+ * and puts the others back.
+ */
+void TimerManager::Expire(int slot, uint64_t now) {
+  for (uint32_t i = TakeSlot(0, slot); i != 0; ) {
+    const uint32_t next = nodes_[i].next;
+    auto &t = nodes_[i].timer;
+    if (t.DeadlineNanoseconds() > now) {
+      Insert(i);
+      i = next;
       continue;
     }
 
+    const uint64_t late = now - t.DeadlineNanoseconds();
+    ++stat_.fired;
+    stat_.total_late_ns += late;
+    stat_.max_late_ns = std::max(stat_.max_late_ns, late);
+
     Message m{Message::kTimerTimeout};
     m.arg.timer.timeout = t.Timeout();
     m.arg.timer.value = t.Value();
-    task_manager->SendMessage(t.TaskID(), m);
+    const bool task_alive = !task_manager->SendMessage(t.TaskID(), m);
 
-    timers_.pop();
+    if (t.PeriodNanoseconds() > 0 && task_alive) {
+      t.Rearm(now);
+      Insert(i);
+    } else {
+      Release(i);
+    }
+    i = next;
   }
-
-  return task_timer_timeout;
 }
 
 TimerManager *timer_manager;
 unsigned long lapic_timer_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext &ctx_stack) {
-  const bool task_timer_timeout = timer_manager->Tick();
+  // Not a KernelLockGuard: SwitchTask doesn't return if it switches tasks,
+  // and the next task keeps the lock (or RestoreContext releases it).
+  const bool locked = AcquireKernelLock();
+
+  // The timer is one-shot, so this may come long after the last interrupt
+  // or early because of KickTaskTimer; either way it acts on the clock.
+  const int cpu = CurrentCPU();
+  ++interrupts[cpu];
+  if (cpu == 0) {
+    timer_manager->Tick();
+  }
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
+  const uint64_t now = __builtin_ia32_rdtsc();
+  const bool switch_task = task_manager &&
+    (now >= slice_end[cpu] || task_manager->IdleWithWork(cpu));
+  if (switch_task) {
+    slice_end[cpu] = now + tsc_per_slice;
+  }
+  ArmTimer(cpu, now);
+
+  if (switch_task) {
     task_manager->SwitchTask(ctx_stack);
   }
+  if (locked) {
+    ReleaseKernelLock();
+  }
 }
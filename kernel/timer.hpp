@@ -1,50 +1,170 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
+#include <vector>
 
+#include "error.hpp"
 #include "message.hpp"
+#include "slab.hpp"
 
+/** @brief Calibrates the local APIC timer and the TSC against the ACPI
+ * PM timer and starts the timer of the bootstrap processor.
+ *
+ * The timer runs one-shot (or in TSC-deadline mode if available) and is
+ * armed for the next event only: the end of the time slice of the running
+ * task or the next timeout of timer_manager. Ticks are derived from the
+ * TSC, so they keep counting while no interrupt comes.
+ */
 void InitializeLAPICTimer();
+
+/** @brief Starts the timer of the running processor.
+ * InitializeLAPICTimer calls it on the bootstrap processor.
+ */
+void StartLAPICTimerOnCPU();
+
+/** @brief Makes cpu arm its timer again, e.g. after a task was queued on
+ * it while it had nothing to run. Other processors are sent an IPI.
+ */
+void KickTaskTimer(int cpu);
+
+/** @brief Returns the number of timer interrupts cpu has taken. */
+unsigned long TimerInterrupts(int cpu);
+
+/** @brief Returns the time since InitializeLAPICTimer in nanoseconds,
+ * read from the TSC.
+ */
+uint64_t CurrentNanoseconds();
+
+/** @brief Returns the TSC frequency (Hz) measured against the PM timer. */
+uint64_t TSCFrequency();
+
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+/** @brief Identifies a timer added to TimerManager. 0 is never a handle. */
+using TimerHandle = uint64_t;
+
 class Timer {
   public:
+    /** @brief A timer expiring at the tick timeout. */
     Timer(unsigned long timeout, int value, uint64_t task_id);
+    /** @brief A timer expiring at deadline_ns (CurrentNanoseconds).
+     * timeout is passed to the task as it is, in any unit the creator likes.
+     */
+    Timer(uint64_t deadline_ns, unsigned long timeout, int value, uint64_t task_id);
+    /** @brief Makes the timer expire every period_ns after its deadline.
+     * Timeout() advances by timeout_period at each expiry.
+     */
+    Timer &SetPeriod(uint64_t period_ns, unsigned long timeout_period);
     unsigned long Timeout() const { return timeout_; }
+    uint64_t DeadlineNanoseconds() const { return deadline_ns_; }
+    uint64_t PeriodNanoseconds() const { return period_ns_; }
     int Value() const { return value_; }
     uint64_t TaskID() const { return task_id_; }
 
   private:
+    uint64_t deadline_ns_;
     unsigned long timeout_;
     int value_;
     uint64_t task_id_;
+    uint64_t period_ns_{0};
+    unsigned long timeout_period_{0};
+
+    /** @brief Moves the deadline of a periodic timer to the first period
+     * after now_ns, skipping the periods missed.
+     */
+    void Rearm(uint64_t now_ns);
+
+    friend class TimerManager;
 };
 
-/** @brief Compares timer priority.
- * The further away the timeout is, the lower the priority is.
- */
-inline bool operator<(const Timer &lhs, const Timer &rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
+struct TimerStat {
+  unsigned long fired;
+  uint64_t total_late_ns, max_late_ns; // time from deadlines to expiry
+};
 
+/** @brief Keeps timers in a hierarchical timing wheel.
+ *
+ * A slot of level 0 spans 2^kWheelShift ns and a slot of level L spans
+ * kWheelSlots slots of level L-1. A timer is put in the lowest level whose
+ * range reaches its deadline and moves down when the wheel comes to its
+ * slot, so adding and cancelling a timer are O(1), and Tick skips the empty
+ * slots with the occupancy bitmaps. Timers expire at their exact deadlines;
+ * slots only group them.
+ */
 class TimerManager {
   public:
   TimerManager();
-  void AddTimer(const Timer &timer);
-  bool Tick();
-  unsigned long CurrentTick() const { return tick_; }
+  /** @brief Adds a timer.
+   * @return the handle CancelTimer takes
+   */
+  TimerHandle AddTimer(const Timer &timer);
+  /** @brief Removes a timer before it expires. Periodic timers keep their
+   * handles until they are cancelled.
+   * @return kNoSuchEntry if the timer has expired or is cancelled
+   */
+  Error CancelTimer(TimerHandle handle);
+  /** @brief Cancels a timer an application of a task created.
+   * @return kNoSuchEntry if the timer doesn't exist, kNotPermitted if it
+   *   belongs to another task or to the kernel
+   */
+  Error CancelAppTimer(TimerHandle handle, uint64_t task_id);
+  /** @brief Cancels all timers of a finishing task. */
+  void CancelTaskTimers(uint64_t task_id);
+  /** @brief Cancels the timers an application created in a task
+   * (those with negative values).
+   */
+  void CancelAppTimers(uint64_t task_id);
+  /** @brief Sends the messages of the timers expired by now. */
+  void Tick();
+  unsigned long CurrentTick() const;
+  /** @brief Returns the earliest deadline of the timers, or the maximum of
+   * uint64_t if there is none.
+   */
+  uint64_t NextDeadline() const;
+  TimerStat Stat() const { return stat_; }
 
   private:
-    volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    static const int kWheelShift = 16; // 65.536 us
+    static const int kWheelBits = 6;
+    static const int kWheelSlots = 1 << kWheelBits;
+    static const int kWheelLevels = 4;
+
+    struct Node {
+      Timer timer;
+      uint32_t generation;
+      uint32_t prev, next; // in the list of the slot, 0 terminates
+      int bucket;          // level * kWheelSlots + slot, -1 if not in use
+    };
+
+    TimerStat stat_{};
+    /** @brief The slot of level 0 the wheel is at, in units of 2^kWheelShift ns.
+     * Slots before it have been processed.
+     */
+    uint64_t wheel_unit_{0};
+    std::vector<Node, SlabAllocator<Node>> nodes_{}; // nodes_[0] is unused
+    std::vector<uint32_t, SlabAllocator<uint32_t>> free_nodes_{};
+    std::array<uint32_t, kWheelLevels * kWheelSlots> heads_{};
+    std::array<uint64_t, kWheelLevels> occupied_{}; // bitmaps of non-empty slots
+
+    /** @brief Returns the node index of a live timer, 0 if there is none. */
+    uint32_t Find(TimerHandle handle) const;
+    void Insert(uint32_t index);
+    void Unlink(uint32_t index);
+    void Release(uint32_t index);
+    uint32_t TakeSlot(int level, int slot);
+    int FirstSlot(int level) const;
+    uint64_t SlotUnit(int level, int slot) const;
+    void Expire(int slot, uint64_t now);
+    template <class Pred>
+    void CancelTimersIf(Pred pred);
 };
 
 extern TimerManager *timer_manager;
 extern unsigned long lapic_timer_freq;
 const int kTimerFreq = 100;
+const uint64_t kNanosecondsPerTick = 1'000'000'000 / kTimerFreq;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
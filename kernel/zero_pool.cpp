@@ -0,0 +1,92 @@
+#include "zero_pool.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "interrupt.hpp"
+
+namespace {
+  /** @brief The capacity of the pool in frames (1 MiB) */
+  const size_t kZeroPoolFrames = 256;
+  /** @brief Free frames below which the idle task leaves them alone */
+  const size_t kLowFreeFrames = 2048;
+
+  std::array<size_t, kZeroPoolFrames> pool{}; // frame IDs
+  size_t num_pooled = 0;
+  ZeroPoolStat stat{};
+
+  void ZeroFrameNonTemporal(FrameID frame) {
+    auto p = reinterpret_cast<long long*>(frame.Frame());
+    for (size_t i = 0; i < kBytesPerFrame / sizeof(*p); i += 4) {
+      __builtin_ia32_movnti64(p + i + 0, 0);
+      __builtin_ia32_movnti64(p + i + 1, 0);
+      __builtin_ia32_movnti64(p + i + 2, 0);
+      __builtin_ia32_movnti64(p + i + 3, 0);
+    }
+    // Non-temporal stores are weakly ordered;
+    // make them visible before the frame is handed out.
+    __asm__ volatile("sfence" ::: "memory");
+  }
+} // namespace
+
+WithError<FrameID> AllocateZeroedFrame() {
+  const bool intr = SaveAndDisableInterrupts();
+  if (num_pooled > 0) {
+    const FrameID frame{pool[--num_pooled]};
+    ++stat.hits;
+    RestoreInterrupts(intr);
+    return { frame, MAKE_ERROR(Error::kSuccess) };
+  }
+  ++stat.misses;
+  RestoreInterrupts(intr);
+
+  auto frame = memory_manager->Allocate(1);
+  if (frame.error) {
+    return frame;
+  }
+  memset(frame.value.Frame(), 0, kBytesPerFrame);
+  return frame;
+}
+
+bool RefillZeroPool() {
+  __asm__("cli");
+  const auto m_stat = memory_manager->Stat();
+  if (num_pooled == kZeroPoolFrames ||
+      m_stat.total_frames - m_stat.allocated_frames < kLowFreeFrames) {
+    __asm__("sti");
+    return false;
+  }
+  auto [ frame, err ] = memory_manager->Allocate(1);
+  __asm__("sti");
+  if (err) {
+    return false;
+  }
+
+  ZeroFrameNonTemporal(frame);
+
+  __asm__("cli");
+  pool[num_pooled++] = frame.ID();
+  ++stat.refills;
+  __asm__("sti");
+  return true;
+}
+
+size_t DrainZeroPool(size_t num_frames) {
+  const bool intr = SaveAndDisableInterrupts();
+  size_t drained = 0;
+  for (; drained < num_frames && num_pooled > 0; ++drained) {
+    memory_manager->Free(FrameID{pool[--num_pooled]}, 1);
+  }
+  stat.drained += drained;
+  RestoreInterrupts(intr);
+  return drained;
+}
+
+ZeroPoolStat GetZeroPoolStat() {
+  __asm__("cli");
+  auto s = stat;
+  s.frames = num_pooled;
+  __asm__("sti");
+  return s;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+
+struct ZeroPoolStat {
+  size_t frames;        // zeroed frames in the pool
+  size_t hits, misses;  // AllocateZeroedFrame served from the pool or not
+  size_t refills;       // frames zeroed by the idle task
+  size_t drained;       // frames given back under memory pressure
+};
+
+/** @brief Returns a zeroed frame, taking it from the pool of frames the
+ * idle task has zeroed in advance. Falls back to zeroing a newly
+ * allocated frame if the pool is empty.
+ *
+ * May be called with interrupts disabled, e.g. from the page fault handler.
+ */
+WithError<FrameID> AllocateZeroedFrame();
+
+/** @brief Zeroes a frame and adds it to the pool unless the pool is full.
+ *
+ * Called by the idle task, which stores zeros with non-temporal
+ * stores so that zeroing doesn't evict the caches of other tasks.
+ * @return false if the pool is full or no frame is available
+ */
+bool RefillZeroPool();
+
+/** @brief Returns up to num_frames pooled frames to the memory manager,
+ * so that memory pressure takes them before swapping or evicting.
+ * @return The number of frames freed
+ */
+size_t DrainZeroPool(size_t num_frames);
+
+ZeroPoolStat GetZeroPoolStat();
@@ -0,0 +1,209 @@
+// Host-side benchmark of BitmapMemoryManager.
+//
+// Compares the buddy free lists of BitmapMemoryManager with the former
+// linear bitmap scan under a churn of mixed 1-frame and N-frame requests.
+// The managed frames are backed by an anonymous mapping placed at a fixed
+// address, because free block headers are written into the frames.
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+int Log(LogLevel, const char *, ...) {
+  return 0;
+}
+
+namespace {
+
+const uintptr_t kArenaBase = 0x4000'0000;
+const size_t kArenaFrames = 64 * 1024; // 256 MiB
+const size_t kBeginFrame = kArenaBase / kBytesPerFrame;
+const size_t kEndFrame = kBeginFrame + kArenaFrames;
+
+/** @brief The allocation algorithm BitmapMemoryManager used before
+ * the buddy free lists: a first-fit scan from the beginning of the range.
+ */
+class LinearScanAllocator {
+  public:
+    LinearScanAllocator() : alloc_map_(kEndFrame / 64 + 1) {}
+
+    WithError<FrameID> Allocate(size_t num_frames) {
+      size_t start_frame_id = kBeginFrame;
+      while (true) {
+        size_t i = 0;
+        for (; i < num_frames; ++i) {
+          if (start_frame_id + i >= kEndFrame) {
+            return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+          }
+          if (GetBit(start_frame_id + i)) {
+            break;
+          }
+        }
+        if (i == num_frames) {
+          for (size_t j = 0; j < num_frames; ++j) {
+            SetBit(start_frame_id + j, true);
+          }
+          return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
+        }
+        start_frame_id += i + 1;
+      }
+    }
+
+    Error Free(FrameID start_frame, size_t num_frames) {
+      for (size_t i = 0; i < num_frames; ++i) {
+        SetBit(start_frame.ID() + i, false);
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+  private:
+    std::vector<uint64_t> alloc_map_;
+
+    bool GetBit(size_t frame) const {
+      return (alloc_map_[frame / 64] >> (frame % 64)) & 1;
+    }
+
+    void SetBit(size_t frame, bool allocated) {
+      if (allocated) {
+        alloc_map_[frame / 64] |= uint64_t{1} << (frame % 64);
+      } else {
+        alloc_map_[frame / 64] &= ~(uint64_t{1} << (frame % 64));
+      }
+    }
+};
+
+struct Op {
+  bool allocate;
+  size_t num_frames; // for allocate
+  size_t index;      // for free: index into the live allocations
+};
+
+/** @brief Builds a churn keeping roughly 75% of the arena in use.
+ * 80% of requests are for a single frame, the rest for 2 to 64 frames.
+ */
+std::vector<Op> MakeChurn(size_t num_ops) {
+  std::mt19937_64 rng{42};
+  std::vector<Op> ops;
+  size_t live = 0, live_frames = 0;
+  std::vector<size_t> sizes;
+  for (size_t n = 0; n < num_ops; ++n) {
+    const bool allocate =
+      live == 0 || (live_frames < kArenaFrames * 3 / 4 && rng() % 2 == 0);
+    if (allocate) {
+      const size_t num_frames = rng() % 5 == 0 ? 2 + rng() % 63 : 1;
+      ops.push_back({true, num_frames, 0});
+      sizes.push_back(num_frames);
+      ++live;
+      live_frames += num_frames;
+    } else {
+      const size_t index = rng() % live;
+      ops.push_back({false, 0, index});
+      live_frames -= sizes[index];
+      sizes[index] = sizes.back();
+      sizes.pop_back();
+      --live;
+    }
+  }
+  return ops;
+}
+
+template <class Allocator>
+double RunChurn(Allocator &allocator, const std::vector<Op> &ops,
+                std::vector<uint8_t> *owner) {
+  struct Allocation { size_t frame, num_frames; };
+  std::vector<Allocation> live;
+  size_t failures = 0;
+
+  const auto begin = std::chrono::steady_clock::now();
+  for (const auto &op : ops) {
+    if (op.allocate) {
+      auto [ frame, err ] = allocator.Allocate(op.num_frames);
+      if (err) {
+        ++failures;
+        live.push_back({0, 0});
+        continue;
+      }
+      if (owner) {
+        for (size_t i = 0; i < op.num_frames; ++i) {
+          auto &o = (*owner)[frame.ID() + i - kBeginFrame];
+          if (frame.ID() + i >= kEndFrame || o) {
+            fprintf(stderr, "frame %zu is allocated twice\n", frame.ID() + i);
+            exit(1);
+          }
+          o = 1;
+        }
+      }
+      live.push_back({frame.ID(), op.num_frames});
+    } else {
+      const auto a = live[op.index];
+      live[op.index] = live.back();
+      live.pop_back();
+      if (a.num_frames == 0) {
+        continue;
+      }
+      if (owner) {
+        for (size_t i = 0; i < a.num_frames; ++i) {
+          (*owner)[a.frame + i - kBeginFrame] = 0;
+        }
+      }
+      allocator.Free(FrameID{a.frame}, a.num_frames);
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  for (const auto &a : live) {
+    if (a.num_frames > 0) {
+      allocator.Free(FrameID{a.frame}, a.num_frames);
+    }
+  }
+  if (failures > 0) {
+    printf("  (%zu allocations failed)\n", failures);
+  }
+  return std::chrono::duration<double, std::nano>(end - begin).count() /
+         ops.size();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const size_t num_ops = argc > 1 ? atol(argv[1]) : 200'000;
+
+  void *arena = mmap(reinterpret_cast<void*>(kArenaBase),
+                     kArenaFrames * kBytesPerFrame, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (arena != reinterpret_cast<void*>(kArenaBase)) {
+    fprintf(stderr, "failed to map the arena at %#lx\n", kArenaBase);
+    return 1;
+  }
+
+  const auto ops = MakeChurn(num_ops);
+
+  std::vector<uint8_t> map_buf(
+    BitmapMemoryManager::MapBytes(FrameID{kEndFrame}));
+  auto buddy = std::make_unique<BitmapMemoryManager>(
+    FrameID{kEndFrame}, map_buf.data());
+  buddy->SetMemoryRange(FrameID{kBeginFrame}, FrameID{kEndFrame});
+  std::vector<uint8_t> owner(kArenaFrames);
+  RunChurn(*buddy, ops, &owner); // check that no frame is handed out twice
+  if (const auto stat = buddy->Stat(); stat.allocated_frames != 0) {
+    fprintf(stderr, "%zu frames leaked\n", stat.allocated_frames);
+    return 1;
+  }
+
+  LinearScanAllocator linear;
+  printf("%zu ops over %zu frames\n", ops.size(), kArenaFrames);
+  printf("linear scan: %10.1f ns/op\n", RunChurn(linear, ops, nullptr));
+  printf("buddy      : %10.1f ns/op\n", RunChurn(*buddy, ops, nullptr));
+  return 0;
+}